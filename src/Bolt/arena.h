@@ -0,0 +1,132 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+#include <type_traits>
+
+// 事务级别的内存池。对象从大块内存里顺序切出来，不单独释放，
+// 事务commit/rollback时reset()一次性析构并回收。
+// Not thread safe, a transaction is only used by one thread at a time.
+class Arena {
+public:
+  explicit Arena(size_t blockSize = 4096)
+      : blockSize_(blockSize), blocks_(), cur_(nullptr), end_(nullptr),
+        dtors_(), allocated_(0) {}
+  ~Arena() {
+    reset();
+    for (auto &block : blocks_) {
+      ::free(block.first);
+    }
+  }
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  void *allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+    allocated_ += size;
+    auto ptr = align(cur_, alignment);
+    if (cur_ != nullptr && ptr + size <= end_) {
+      cur_ = ptr + size;
+      return ptr;
+    }
+    if (cur_ != nullptr && size + alignment > blockSize_ * 4) {
+      // big requests (eg. multi-page dirty pages) get a block of their own,
+      // so the current block keeps filling up.
+      auto block = static_cast<char *>(::malloc(size + alignment));
+      assert(block);
+      blocks_.emplace_back(block, size + alignment);
+      return align(block, alignment);
+    }
+    newBlock(size + alignment);
+    ptr = align(cur_, alignment);
+    cur_ = ptr + size;
+    return ptr;
+  }
+
+  // construct a T inside the arena, its destructor runs on reset().
+  template <typename T, typename... Args> T *make(Args &&... args) {
+    auto ptr = new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value) {
+      dtors_.emplace_back(ptr, [](void *p) { static_cast<T *>(p)->~T(); });
+    }
+    return ptr;
+  }
+
+  // destroy every object made by make(), in reverse order, and give back
+  // all the memory. The first block is kept for reuse.
+  void reset() {
+    // destructors may still touch memory of objects destroyed after them
+    // (eg. containers using ArenaAllocator), so nothing is freed until all
+    // of them ran.
+    while (!dtors_.empty()) {
+      auto dtor = dtors_.back();
+      dtors_.pop_back();
+      dtor.second(dtor.first);
+    }
+    for (size_t i = 1; i < blocks_.size(); i++) {
+      ::free(blocks_[i].first);
+    }
+    if (!blocks_.empty()) {
+      blocks_.resize(1);
+      cur_ = blocks_[0].first;
+      end_ = cur_ + blocks_[0].second;
+    }
+    allocated_ = 0;
+  }
+
+  size_t allocated() const { return allocated_; }
+
+private:
+  static char *align(char *ptr, size_t alignment) {
+    auto p = reinterpret_cast<uintptr_t>(ptr);
+    return reinterpret_cast<char *>((p + alignment - 1) & ~(alignment - 1));
+  }
+
+  void newBlock(size_t minSize) {
+    // the first block is the one kept across reset().
+    size_t size = blocks_.empty() ? blockSize_ : blockSize_ * 16;
+    if (size < minSize) {
+      size = minSize;
+    }
+    auto block = static_cast<char *>(::malloc(size));
+    assert(block);
+    blocks_.emplace_back(block, size);
+    cur_ = block;
+    end_ = block + size;
+  }
+
+  size_t blockSize_;
+  std::vector<std::pair<char *, size_t> > blocks_; // start, size
+  char *cur_;
+  char *end_;
+  std::vector<std::pair<void *, void (*)(void *)> > dtors_;
+  size_t allocated_;
+};
+
+// STL allocator on top of an Arena, deallocate() is a no-op.
+template <typename T> struct ArenaAllocator {
+  typedef T value_type;
+  explicit ArenaAllocator(Arena *arena) : arena_(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other)
+      : arena_(other.arena_) {}
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *, size_t) {}
+  template <typename U> bool operator==(const ArenaAllocator<U> &o) const {
+    return arena_ == o.arena_;
+  }
+  template <typename U> bool operator!=(const ArenaAllocator<U> &o) const {
+    return arena_ != o.arena_;
+  }
+  Arena *arena_;
+};
+
+#endif // ARENA_H_
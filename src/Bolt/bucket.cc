@@ -2,12 +2,15 @@
 #include "tx.h"
 #include "meta.h"
 #include "db.h"
+#include <algorithm>
 #include <cstring>
 #include "page.h"
 
-Bucket::Bucket(TxPtr tx_ptr)
-    : bucketHeader_(), tx_(tx_ptr), buckets_(), page_(nullptr),
-      rootNode_(nullptr), nodes_(), fillPercent_(DEFAULTFILLPERCENT) {}
+Bucket::Bucket(Tx *tx_ptr)
+    : bucketHeader_(), tx_(tx_ptr), buckets_(), page_(nullptr), value_(),
+      rootNode_(nullptr), nodes_(), fillPercent_(DEFAULTFILLPERCENT),
+      fillPercentSet_(false), appended_(false), randomWrite_(false),
+      lastLeaf_(nullptr), rootChanged_(false) {}
 
 NodePtr Bucket::getCachedNode(pgid pgid) {
   auto it = nodes_.find(pgid);
@@ -17,6 +20,14 @@ NodePtr Bucket::getCachedNode(pgid pgid) {
   return nullptr;
 }
 
+Bucket *Bucket::getCachedBucket(const Item &name) {
+  auto it = buckets_.find(name);
+  if (it != buckets_.end()) {
+    return it->second;
+  }
+  return nullptr;
+}
+
 void Bucket::free() {
   if (bucketHeader_.root == 0) {
     return;
@@ -47,47 +58,39 @@ void Bucket::dereference() {
 }
 
 // Item中存放的是bucketHeader
-Bucket *Bucket::openBucket(Item value, void *ptr) {
+Bucket *Bucket::openBucket(const Item &value) {
   auto child = newBucket(tx_);
 
-  // TODO(roland):memory management
-  // if (child->tx_->isWritable()) {
-  //   std::memcpy((char *) &child->bucketHeader_, value.c_str(),
-  //               sizeof(bucketHeader));
-  // } else {
-  //   child->bucketHeader =
-  //       *(reinterpret_cast<bucketHeader *>(const_cast<char
-  // *>(value.pointer)));
-  // }
-
-  memmove((char *)&child->bucketHeader_, value.c_str(), sizeof(bucketHeader));
-  // bucketHeader *tmp = reinterpret_cast<bucketHeader*>(value.c_str());
+  // If this is a writable transaction then we need to copy the bucket entry,
+  // the mmap may be remapped under it. Read-only transactions can point
+  // directly at the mmap entry.
+  if (tx_->isWritable()) {
+    child->value_ = value.clone();
+  } else {
+    child->value_ = value;
+  }
+
+  memmove((char *)&child->bucketHeader_, child->value_.c_str(),
+          sizeof(bucketHeader));
   // is this a inline bucket?
   if (child->bucketHeader_.root == 0) {
     LOG(INFO) << "this is a inline bucket.";
-    if (ptr) {
-      child->page_ = reinterpret_cast<Page *>(
-          &(((leafPageElement *)ptr)->valuePtr())[BUCKETHEADERSIZE]);
-      // 指针乱指的下场
-      // LOG(INFO) << "using page bucket address: " <<
-      // (&((leafPageElement*)ptr)->valuePtr())[BUCKETHEADERSIZE];
-      // LOG(INFO) << "using page bucket address: " <<
-      // (&((leafPageElement*)ptr)->valuePtr());
-      // LOG(INFO) << "using page bucket address: " <<
-      // (&((leafPageElement*)ptr));
-    } else {
-      child->page_ =
-          reinterpret_cast<Page *>(&(value.c_str())[BUCKETHEADERSIZE]);
-    }
+    child->page_ =
+        reinterpret_cast<Page *>(&(child->value_.c_str())[BUCKETHEADERSIZE]);
   }
   return child;
 }
 
-Bucket *Bucket::newBucket(TxPtr tx) {
-  auto bucket = new Bucket(tx);
+Bucket *Bucket::newBucket(Tx *tx) {
+  auto bucket = tx->pool_.make<Bucket>(tx);
   return bucket;
 }
 
+// nodes are owned by the transaction's pool and released when it closes.
+NodePtr Bucket::newNode(NodePtr parentNode) {
+  return tx_->pool_.make<Node>(this, parentNode);
+}
+
 Bucket *Bucket::getBucketByName(const Item &searchKey) {
   auto iter = buckets_.find(searchKey);
   if (iter != buckets_.end()) {
@@ -98,21 +101,24 @@ Bucket *Bucket::getBucketByName(const Item &searchKey) {
   Item key;
   Item value;
   uint32_t flag = 0;
-  void *ptr = cursor->seek(searchKey, key, value, flag);
-  if (searchKey.data_ != key.data_ || !(flag & bucketLeafFlag)) {
+  cursor->seek(searchKey, key, value, flag);
+  if (searchKey != key || !(flag & bucketLeafFlag)) {
     LOG(ERROR) << "getBucketByName failed! no bucket exist.";
     return nullptr;
   }
 
-  auto result = openBucket(value, ptr);
-  buckets_[searchKey] = result;
-  LOG(INFO) << "get bucket " << searchKey.data_ << " success!";
+  auto result = openBucket(value);
+  if (tx_->conflicts_ != nullptr) {
+    result->path_ = ConflictSet::childPath(path_, searchKey);
+  }
+  buckets_[searchKey.clone()] = result;
+  LOG(INFO) << "get bucket " << searchKey.toString() << " success!";
   return result;
 }
 
 Cursor *Bucket::createCursor() {
   tx_->increaseCurserCount();
-  auto ret = new Cursor(this);
+  auto ret = tx_->pool_.make<Cursor>(this);
   // LOG(INFO) << "create new cursor: " << ret;
   return ret;
 }
@@ -140,20 +146,24 @@ Bucket *Bucket::createBucket(const Item &key) {
 
   // create an empty inline bucket
   Bucket bucket(tx_);
-  bucket.rootNode_ = make_shared<Node>(&bucket, nullptr); // root node
+  bucket.rootNode_ = bucket.newNode(nullptr); // root node
   bucket.rootNode_->markLeaf();
 
   auto putValue = bucket.write();
 
   // key就是bucket的名字，value就是（bucketheader + node）
+  recordWrite(false);
   c.getNode()->put(key, key, putValue, 0, bucketLeafFlag);
 
   // Since subbuckets are not allowed on inline buckets, we need to
   // dereference the inline page, if it exists. This will cause the bucket
   // to be treated as a regular, non-inline bucket for the rest of the tx.
   page_ = nullptr;
+  if (tx_->conflicts_ != nullptr) {
+    tx_->conflicts_->addWrite(WriteOp::CreateBucket, path_, key);
+  }
   // 通过getBucketByName函数将刚创建的bucket放到buckets_里面去
-  LOG(INFO) << "creat bucket " << key.data_ << " success!";
+  LOG(INFO) << "creat bucket " << key.toString() << " success!";
   return getBucketByName(key);
 }
 
@@ -186,7 +196,7 @@ int Bucket::deleteBucket(const Item &key) {
   Item v;
   uint32_t flag;
   c->seek(key, k, v, flag);
-  if (k.data_ != key.data_ || (flag & bucketLeafFlag)) {
+  if (k != key || (flag & bucketLeafFlag)) {
     LOG(ERROR) << "delete Bucket failed!";
     return -1;
   }
@@ -210,9 +220,14 @@ int Bucket::deleteBucket(const Item &key) {
 
   child->nodes_.clear();
   child->rootNode_ = nullptr;
+  child->lastLeaf_ = nullptr;
   child->free();
 
+  recordWrite(false);
   c->getNode()->del(key);
+  if (tx_->conflicts_ != nullptr) {
+    tx_->conflicts_->addWrite(WriteOp::DeleteBucket, path_, key);
+  }
 
   return 0;
 }
@@ -225,30 +240,36 @@ NodePtr Bucket::getNode(pgid pgid, NodePtr parentNode) {
   }
 
   // otherwise make a new node.
-  auto node = make_shared<Node>(this, parentNode_);
-  if (parentNode_ == nullptr) {
+  auto node = newNode(parentNode);
+  if (parentNode == nullptr) {
     rootNode_ = node;
   } else {
-    parentNode_->addChild(node);
+    parentNode->addChild(node);
   }
 
   // Use the inline page if this is an inline bucket.
-  if (page_ == nullptr) {
-    page_ = tx_->getPage(pgid);
+  auto page = page_;
+  if (page == nullptr) {
+    page = tx_->getPage(pgid);
   }
-  node->read(page_);
+  node->read(page);
   nodes_[pgid] = node;
   // tx_->stats_.nodeCount++;
   return node;
 }
 
-uint32_t Bucket::getTotalPageNumber() {
+pgid Bucket::getTotalPageNumber() {
   return tx_->metaData_->totalPageNumber_;
 }
 
 void Bucket::rebalance() {
-  for (auto &item : nodes_) {
-    item.second->rebalance();
+  // Node::rebalance()会把合并掉的node从nodes_里删掉，遍历一份拷贝，跳过已经删掉的
+  std::vector<std::pair<pgid, NodePtr> > nodes(nodes_.begin(), nodes_.end());
+  for (auto &item : nodes) {
+    auto it = nodes_.find(item.first);
+    if (it != nodes_.end() && it->second == item.second) {
+      item.second->rebalance();
+    }
   }
 
   for (auto &item : buckets_) {
@@ -289,22 +310,10 @@ bool Bucket::spill() {
     auto child = item.second;
 
     Item newValue;
-
-    if (child->isInlineable()) {
-      // 如果可以inline，就将bucket和node数据都写到newValue中，然后put进去
-      child->free();
-      newValue = child->write();
-    } else {
-      if (!child->spill()) {
-        LOG(ERROR) << "child bucket spill failed!";
-        return false;
-      }
-
-      newValue = Item(reinterpret_cast<char *>(&child->bucketHeader_),
-                      sizeof(struct bucketHeader));
+    if (!spillChild(child, newValue)) {
+      return false;
     }
-
-    if (child->rootNode_ == nullptr) {
+    if (newValue.empty()) {
       continue;
     }
 
@@ -330,13 +339,14 @@ bool Bucket::spill() {
     return true;
   }
 
-  auto ret = rootNode_->spill();
-  if (ret) {
+  if (rootNode_->spill()) {
     LOG(ERROR) << "node spill failed!";
-    return ret;
+    return false;
   }
 
   rootNode_ = rootNode_->root();
+  // 分裂之后最右边的叶子变了
+  lastLeaf_ = nullptr;
 
   if (rootNode_->getPageId() >= tx_->metaData_->totalPageNumber_) {
     assert(false);
@@ -346,6 +356,35 @@ bool Bucket::spill() {
   return true;
 }
 
+bool Bucket::spillChild(Bucket *child, Item &newValue) {
+  newValue.reset();
+  if (child->isInlineable()) {
+    // 如果可以inline，就将bucket和node数据都写到newValue中，然后put进去
+    child->free();
+    newValue = child->write();
+  } else {
+    if (!child->spill()) {
+      LOG(ERROR) << "child bucket spill failed!";
+      return false;
+    }
+    if (child->rootNode_ != nullptr || child->rootChanged_) {
+      newValue = Item(reinterpret_cast<char *>(&child->bucketHeader_),
+                      sizeof(struct bucketHeader));
+    }
+  }
+  return true;
+}
+
+void Bucket::putChild(const Item &name, const Item &value) {
+  auto c = createCursor();
+  Item k;
+  Item v;
+  uint32_t flag = 0;
+  c->seek(name, k, v, flag);
+  assert(k != name || (flag & bucketLeafFlag));
+  c->getNode()->put(name, name, value, 0, bucketLeafFlag);
+}
+
 int Bucket::for_each(std::function<int(const Item &, const Item &)> fn) {
   if (tx_->db_ == nullptr) {
     return -1;
@@ -441,19 +480,36 @@ int Bucket::put(const Item &key, const Item &value) {
     return -1;
   }
 
-  auto c = createCursor();
-  Item k;
-  Item v;
-  uint32_t flag = 0;
+  // 顺序追加时不用从根往下找
+  auto count = lastLeaf_ != nullptr ? lastLeaf_->numChildren() : 0;
+  if (count > 0 && lastLeaf_->getInode(count - 1).key < key) {
+    recordWrite(true);
+    lastLeaf_->append(key, value);
+  } else {
+    auto c = createCursor();
+    Item k;
+    Item v;
+    uint32_t flag = 0;
 
-  c->seek(key, k, v, flag);
+    // 写的结果不依赖读到的值，不记到乐观事务的读集合里
+    c->do_seek(key, k, v, flag);
 
-  if (k == key && (flag & bucketLeafFlag)) {
-    LOG(FATAL) << "impossible!";
-    return -1;
-  }
+    if (k == key && (flag & bucketLeafFlag)) {
+      LOG(FATAL) << "impossible!";
+      return -1;
+    }
 
-  c->getNode()->put(key, key, value, 0, 0);
+    bool append = k.empty() && c->afterLast();
+    recordWrite(append);
+    auto node = c->getNode();
+    node->put(key, key, value, 0, 0);
+    if (append) {
+      lastLeaf_ = node;
+    }
+  }
+  if (tx_->conflicts_ != nullptr) {
+    tx_->conflicts_->addWrite(WriteOp::Put, path_, key, value);
+  }
   return 0;
 }
 
@@ -468,14 +524,18 @@ int Bucket::remove(const Item &key) {
   Item v;
   uint32_t flag = 0;
 
-  c->seek(key, k, v, flag);
+  c->do_seek(key, k, v, flag);
 
   if (flag & bucketLeafFlag) {
     LOG(FATAL) << "impossible!";
     return -1;
   }
 
+  recordWrite(false);
   c->getNode()->del(key);
+  if (tx_->conflicts_ != nullptr) {
+    tx_->conflicts_->addWrite(WriteOp::Remove, path_, key);
+  }
   return 0;
 }
 
@@ -489,4 +549,185 @@ Item Bucket::get(const Item &key) {
     return Item();
   }
   return v;
-}
\ No newline at end of file
+}
+
+// bulkLoad建树时的一层。元素攒到一页的阈值就分配页写出去，每页的第一个key和页号交给上一层
+class bulkLevel {
+public:
+  bulkLevel(Tx *tx, bool leaf, uint32_t pageSize, uint32_t threshold)
+      : tx_(tx), leaf_(leaf), pageSize_(pageSize), threshold_(threshold),
+        size_(PAGEHEADERSIZE) {}
+
+  // child只对branch有意义。分配页失败返回false
+  bool add(const Item &key, const Item &value, pgid child) {
+    uint32_t elementSize = sizeof(leafPageElement);
+    if (!leaf_) {
+      elementSize = sizeof(branchPageElement);
+    }
+    auto size = elementSize + key.length_ + value.length_;
+    if (!elements_.empty() &&
+        (size_ + size > threshold_ || elements_.size() == 0xffff)) {
+      if (!flush()) {
+        return false;
+      }
+    }
+    elements_.push_back(element{ key.length_, value.length_, child });
+    data_.append(key.data(), key.length_);
+    data_.append(value.data(), value.length_);
+    size_ += size;
+    return true;
+  }
+
+  // 写出最后一页
+  bool flush() {
+    if (elements_.empty()) {
+      return true;
+    }
+    auto page = tx_->allocate((size_ + pageSize_ - 1) / pageSize_);
+    if (page == nullptr) {
+      return false;
+    }
+    allocated_.push_back(page);
+    page->flag |= leaf_ ? pageFlags::leafPageFlag : pageFlags::branchPageFlag;
+    page->count = elements_.size();
+    // 和Node::write一样：|page header|elements|kv ...|
+    auto elementSize = leaf_ ? sizeof(leafPageElement)
+                             : sizeof(branchPageElement);
+    auto contentPtr = page->ptr + elements_.size() * elementSize;
+    memcpy(contentPtr, data_.data(), data_.size());
+    for (size_t i = 0; i < elements_.size(); i++) {
+      auto &e = elements_[i];
+      if (leaf_) {
+        auto item = page->getLeafPageElement(i);
+        item->pos = contentPtr - reinterpret_cast<char *>(item);
+        item->ksize = e.ksize;
+        item->vsize = e.vsize;
+      } else {
+        auto item = page->getBranchPageElement(i);
+        item->pos = contentPtr - reinterpret_cast<char *>(item);
+        item->ksize = e.ksize;
+        item->pageId = e.child;
+      }
+      contentPtr += e.ksize + e.vsize;
+    }
+    // 和Node::separator一样，叶子的分隔key取比前一页最后一个key大的最短前缀
+    std::string first = data_.substr(0, elements_[0].ksize);
+    if (leaf_ && !pages_.empty()) {
+      size_t size = 0;
+      while (size < lastKey_.size() && lastKey_[size] == first[size]) {
+        size++;
+      }
+      first.resize(std::min(size + 1, first.size()));
+    }
+    pgid id = page->id;
+    pages_.emplace_back(first, id);
+    auto &last = elements_.back();
+    lastKey_ = data_.substr(data_.size() - last.ksize - last.vsize, last.ksize);
+    elements_.clear();
+    data_.clear();
+    size_ = PAGEHEADERSIZE;
+    return true;
+  }
+
+  const std::vector<std::pair<std::string, pgid> > &pages() const {
+    return pages_;
+  }
+  const std::vector<Page *> &allocated() const { return allocated_; }
+
+private:
+  struct element {
+    uint32_t ksize;
+    uint32_t vsize;
+    pgid child;
+  };
+  Tx *tx_;
+  bool leaf_;
+  uint32_t pageSize_;
+  uint32_t threshold_;
+  uint32_t size_; // 当前页写出去的大小
+  std::vector<element> elements_;
+  std::string data_;
+  std::vector<std::pair<std::string, pgid> > pages_; // 写出的页的分隔key和页号
+  std::string lastKey_; // 上一页最后一个key
+  std::vector<Page *> allocated_;
+};
+
+int Bucket::bulkLoad(std::function<bool(Item &key, Item &value)> next,
+                     double fillPercent) {
+  // 乐观写事务重放的是写操作，不是页
+  if (tx_->db_ == nullptr || !isWritable() || tx_->conflicts_ != nullptr) {
+    LOG(ERROR) << "invalid parameter for bulkLoad";
+    return -1;
+  }
+  Item k;
+  Item v;
+  createCursor()->first(k, v);
+  if (!k.empty() || !buckets_.empty()) {
+    LOG(ERROR) << "bulkLoad needs an empty bucket";
+    return -1;
+  }
+  fillPercent = std::max(MINFILLPERCENT, std::min(fillPercent, MAXFILLPERCENT));
+  uint32_t pageSize = tx_->db_->getPageSize();
+  uint32_t threshold = pageSize * fillPercent;
+
+  std::vector<std::unique_ptr<bulkLevel> > levels;
+  levels.emplace_back(new bulkLevel(tx_, true, pageSize, threshold));
+  // 失败时按分配的相反顺序把已经分配的页还回去，bucket不变
+  auto fail = [this, &levels]() {
+    for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+      auto &allocated = (*level)->allocated();
+      for (auto page = allocated.rbegin(); page != allocated.rend(); ++page) {
+        tx_->unallocate(*page);
+      }
+    }
+    return -1;
+  };
+  std::string last;
+  Item key;
+  Item value;
+  while (next(key, value)) {
+    if (key.length_ == 0 || key.length_ > MAXKEYSIZE ||
+        value.length_ > MAXVALUESIZE ||
+        (!last.empty() && key.piece().compare(last) <= 0)) {
+      LOG(ERROR) << "invalid or unsorted key for bulkLoad";
+      return fail();
+    }
+    last.assign(key.data(), key.length_);
+    if (!levels[0]->add(key, value, 0)) {
+      return fail();
+    }
+  }
+  if (!levels[0]->flush()) {
+    return fail();
+  }
+  if (levels[0]->pages().empty()) {
+    return 0;
+  }
+  // 每一层的页的第一个key和页号组成上一层，直到只剩一页
+  while (levels.back()->pages().size() > 1) {
+    auto &children = levels.back()->pages();
+    std::unique_ptr<bulkLevel> level(new bulkLevel(tx_, false, pageSize, threshold));
+    for (auto &child : children) {
+      if (!level->add(Item::ref(child.first.data(), child.first.size()),
+                      Item(), child.second)) {
+        levels.push_back(std::move(level));
+        return fail();
+      }
+    }
+    if (!level->flush()) {
+      levels.push_back(std::move(level));
+      return fail();
+    }
+    levels.push_back(std::move(level));
+  }
+
+  // 换掉原来空的根
+  free();
+  nodes_.clear();
+  rootNode_ = nullptr;
+  lastLeaf_ = nullptr;
+  page_ = nullptr;
+  bucketHeader_.root = levels.back()->pages()[0].second;
+  rootChanged_ = true;
+  return 0;
+}
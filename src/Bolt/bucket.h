@@ -24,26 +24,57 @@ struct bucketHeader {
 
 class Bucket {
 public:
-  explicit Bucket(TxPtr tx_ptr);
+  explicit Bucket(Tx *tx_ptr);
   void setBucketHeader(bucketHeader bucket) { bucketHeader_ = bucket; }
   pgid getRootPage() const { return bucketHeader_.root; }
-  void setTx(TxPtr tx) { this->tx_ = tx; }
-  TxPtr getTx() const { return tx_; }
+  void setTx(Tx *tx) { this->tx_ = tx; }
+  Tx *getTx() const { return tx_; }
   NodePtr getCachedNode(pgid pgid);
+  // 本事务里已经打开过的子bucket，没有打开过返回nullptr
+  Bucket *getCachedBucket(const Item &name);
+  const Item &getValue() const { return value_; }
+  // 乐观写事务里从根bucket到这个bucket的路径，见ConflictSet
+  const std::string &getPath() const { return path_; }
   void eraseCachedNode(pgid pgid) { nodes_.erase(pgid); }
   void dereference();
-  Bucket *openBucket(Item value, void *ptr = nullptr);
-  Bucket *newBucket(TxPtr tx);
+  Bucket *openBucket(const Item &value);
+  Bucket *newBucket(Tx *tx);
+  NodePtr newNode(NodePtr parentNode);
   Bucket *createBucket(const Item &key);
   Bucket *createBucketIfNotExists(const Item &key);
   int deleteBucket(const Item &key);
   NodePtr getNode(pgid pgid, NodePtr parentNode);
-  uint32_t getTotalPageNumber() const;
   double getFillPercent() const { return fillPercent_; }
+  // 本事务里这个bucket的node分裂时每页填到多满，不会持久化。设置之后不再按追加自动调整
+  void setFillPercent(double fillPercent) {
+    fillPercent_ = fillPercent;
+    fillPercentSet_ = true;
+  }
+  // 记下一次写是不是在整个bucket的最后追加
+  void recordWrite(bool append) {
+    if (append) {
+      appended_ = true;
+    } else {
+      randomWrite_ = true;
+    }
+  }
+  // spill时分裂用的填充率。本事务只在最后追加过key时左边的页不会再写入，
+  // 按MAXFILLPERCENT分裂，只在最后一页留空间
+  double splitFillPercent() const {
+    if (!fillPercentSet_ && appended_ && !randomWrite_) {
+      return MAXFILLPERCENT;
+    }
+    return fillPercent_;
+  }
   void rebalance();
   bool isInlineable();
   uint32_t maxInlineBucketSize();
   bool spill();
+  // 把子bucket写成dirty page或者inline value，newValue是它在当前bucket里的新value，
+  // 子bucket没有改动时为空
+  bool spillChild(Bucket *child, Item &newValue);
+  // 把子bucket name的value更新为value，没有这个子bucket时插入
+  void putChild(const Item &name, const Item &value);
   Bucket *getBucketByName(const Item &searchKey);
   Cursor *createCursor();
   void free();
@@ -53,22 +84,35 @@ public:
   void for_each_page_node_impl(pgid pgid, int depth,
                                std::function<void(Page *, NodePtr, int)> fn);
   Item write();
-  uint32_t getTotalPageNumber();
+  pgid getTotalPageNumber();
   void getPageNode(pgid pageId, NodePtr &node, Page *&page);
   bool isWritable() const;
   int put(const Item &key, const Item &value);
   int remove(const Item &key);
   Item get(const Item &key);
+  // 往空的bucket里按key严格递增的顺序批量导入，next每次给出下一个kv，返回false表示结束。
+  // 叶子页按fillPercent依次写满，再逐层往上建branch页，不经过cursor查找和node。
+  // bucket不为空、key不是严格递增或者kv不合法时返回-1，bucket不变
+  int bulkLoad(std::function<bool(Item &key, Item &value)> next,
+               double fillPercent = MAXFILLPERCENT);
 
 private:
   bucketHeader bucketHeader_;
-  TxPtr tx_;                              // 关联的事务
+  Tx *tx_; // 关联的事务，bucket由事务的内存池持有
   unordered_map<Item, Bucket *> buckets_; // 当前bucket的子bucket
   Page *page_; // 当前bucket的page信息,只有inline bucket这个值才有意义
+  Item value_; // bucketHeader + inline page, page_ points into it
   NodePtr rootNode_;                   // B+树根节点
   unordered_map<pgid, NodePtr> nodes_; // 已经缓存的node
   double fillPercent_;                 // 分裂水位、阈值
-  NodePtr parentNode_ = nullptr;
+  bool fillPercentSet_;
+  bool appended_;    // 有put在最后追加
+  bool randomWrite_; // 有不在最后的put，或者remove、创建删除子bucket
+  // 最右边的叶子node。本事务里树的结构在spill之前不变，比它最后一个key大的key都放在它的最后
+  NodePtr lastLeaf_;
+  std::string path_; // 只有乐观写事务打开的bucket才设置
+  // bulkLoad换了根页，没有node也要在spill时把bucketHeader_写回父bucket
+  bool rootChanged_;
 };
 
 const uint32_t BUCKETHEADERSIZE = sizeof(bucketHeader);
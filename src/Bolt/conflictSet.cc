@@ -0,0 +1,91 @@
+#include "conflictSet.h"
+
+void ConflictSet::reset(txid snapshot) {
+  snapshot_ = snapshot;
+  reads_.clear();
+  writes_.clear();
+}
+
+void ConflictSet::addRead(const std::string &path, const Item &lo,
+                          const Item &hi, bool hiInf) {
+  auto &ranges = reads_[path];
+  std::string low = lo.toString();
+  std::string high = hiInf ? std::string() : hi.toString();
+  if (!ranges.empty()) {
+    auto &last = ranges.back();
+    // next()接着上一段往后读
+    if (!last.hiInf && last.lo <= low && low <= last.hi) {
+      if (hiInf || high > last.hi) {
+        last.hi = high;
+        last.hiInf = hiInf;
+      }
+      return;
+    }
+    // prev()接着上一段往前读
+    if ((hiInf ? last.hiInf : last.lo <= high) &&
+        (last.hiInf || high <= last.hi) && low <= last.lo) {
+      last.lo = low;
+      return;
+    }
+  }
+  ranges.push_back(KeyRange{ low, high, hiInf });
+}
+
+void ConflictSet::addWrite(WriteOp op, const std::string &path,
+                           const Item &key, const Item &value) {
+  writes_.push_back(
+      WriteRecord{ op, path, key.toString(), value.toString() });
+}
+
+bool ConflictSet::conflictsWith(const CommittedWrites &committed) const {
+  if (committed.all) {
+    return true;
+  }
+  for (auto &item : committed.keys) {
+    auto ranges = reads_.find(item.first);
+    for (auto &key : item.second) {
+      if (ranges != reads_.end()) {
+        for (auto &range : ranges->second) {
+          if (range.contains(key.first)) {
+            return true;
+          }
+        }
+      }
+      if (!key.second) {
+        continue;
+      }
+      for (auto &write : writes_) {
+        if (write.path == item.first && write.key == key.first) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+void ConflictSet::mergeInto(CommittedWrites &committed) const {
+  for (auto &write : writes_) {
+    bool structural = write.op == WriteOp::CreateBucket ||
+                      write.op == WriteOp::DeleteBucket;
+    committed.keys[write.path].emplace_back(write.key, structural);
+  }
+}
+
+std::string ConflictSet::childPath(const std::string &path,
+                                   const Item &name) {
+  return path + std::to_string(name.length_) + ':' + name.toString();
+}
+
+std::vector<std::string> ConflictSet::splitPath(const std::string &path) {
+  std::vector<std::string> names;
+  size_t pos = 0;
+  while (pos < path.size()) {
+    auto colon = path.find(':', pos);
+    assert(colon != std::string::npos);
+    auto len = std::stoul(path.substr(pos, colon - pos));
+    names.push_back(path.substr(colon + 1, len));
+    pos = colon + 1 + len;
+  }
+  return names;
+}
@@ -0,0 +1,70 @@
+#ifndef CONFLICT_SET_H_
+#define CONFLICT_SET_H_
+
+#include "type.h"
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// 乐观写事务(见DB::updateOptimistic)执行时记下的读集合和写集合，提交时拿来和快照之后提交的
+// 事务比较。bucket用从根bucket开始的路径表示，每一级是"名字长度:名字"，根bucket是空串
+
+enum class WriteOp : uint8_t { Put, Remove, CreateBucket, DeleteBucket };
+
+// 一次写操作，提交时在最新的版本上按顺序重放
+struct WriteRecord {
+  WriteOp op;
+  std::string path;
+  std::string key;
+  std::string value;
+};
+
+// bucket里读过的一段key，两端都包含。lo为空表示从第一个key开始，hiInf表示一直到最后
+struct KeyRange {
+  std::string lo;
+  std::string hi;
+  bool hiInf;
+  bool contains(const std::string &key) const {
+    return key >= lo && (hiInf || key <= hi);
+  }
+};
+
+// 一个已提交的写事务改过的key。all为true时是普通的写事务，不知道它改了什么
+struct CommittedWrites {
+  txid id;
+  bool all;
+  // path -> (key, 是否创建或删除了名为key的子bucket)
+  std::unordered_map<std::string,
+                     std::vector<std::pair<std::string, bool> > > keys;
+  CommittedWrites() : id(0), all(false) {}
+};
+
+class ConflictSet {
+public:
+  ConflictSet() : snapshot_(0) {}
+  // 重试时清空，snapshot是新的快照的txid
+  void reset(txid snapshot);
+  txid snapshot() const { return snapshot_; }
+  // 读了bucket里[lo, hi]这段，和前一段相接时合并，顺序遍历只占一项
+  void addRead(const std::string &path, const Item &lo, const Item &hi,
+               bool hiInf);
+  void addWrite(WriteOp op, const std::string &path, const Item &key,
+                const Item &value = Item());
+  const std::vector<WriteRecord> &writes() const { return writes_; }
+  // committed改过的key落在读过的范围里，或者它创建、删除的子bucket正是这里写的key时冲突。
+  // 只写不读的key被别人改过不算冲突，重放时覆盖
+  bool conflictsWith(const CommittedWrites &committed) const;
+  // 把写过的key记到committed里，同一组里后面的事务要和它比较
+  void mergeInto(CommittedWrites &committed) const;
+
+  static std::string childPath(const std::string &path, const Item &name);
+  static std::vector<std::string> splitPath(const std::string &path);
+
+private:
+  txid snapshot_;
+  std::unordered_map<std::string, std::vector<KeyRange> > reads_;
+  std::vector<WriteRecord> writes_;
+};
+
+#endif // CONFLICT_SET_H_
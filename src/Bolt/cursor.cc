@@ -22,6 +22,21 @@ size_t ElementRef::count() const {
   return page_->count;
 }
 
+// 页里的key都以prefix开头。key比它们都小返回-1，都大返回1，
+// 否则返回0，suffix是key去掉前缀的部分
+static int stripPrefix(const Item &prefix, const Item &key, Item &suffix) {
+  auto n = std::min(prefix.length_, key.length_);
+  int cmp = n == 0 ? 0 : memcmp(key.data(), prefix.data(), n);
+  if (cmp < 0 || (cmp == 0 && key.length_ < prefix.length_)) {
+    return -1;
+  }
+  if (cmp > 0) {
+    return 1;
+  }
+  suffix = Item::ref(key.data() + prefix.length_, key.length_ - prefix.length_);
+  return 0;
+}
+
 void Cursor::search(const Item &key, pgid pgid) {
   // 都是从0开始搜索的
   // LOG(INFO) << "cursor searching pageid: " << pgid;
@@ -60,9 +75,15 @@ void Cursor::searchLeaf(const Item &key) {
   }
 
   // 在page中，但是没构造成node结构
+  Item suffix;
+  auto cmp = stripPrefix(ref.page_->prefix(), key, suffix);
+  if (cmp != 0) {
+    ref.index_ = cmp < 0 ? 0 : ref.page_->count;
+    return;
+  }
   auto ptr = ref.page_->getLeafPageElement(0);
   ref.index_ = static_cast<uint32_t>(
-      binarySearchLeaf(ptr, key, ref.page_->count, found));
+      binarySearchLeaf(ptr, suffix, ref.page_->count, found));
   LOG(INFO) << "cursor search leaf: " << (found ? "found!" : "not found.");
 }
 
@@ -81,7 +102,12 @@ void Cursor::searchBranchNode(const Item &key, NodePtr node) {
 void Cursor::searchBranchPage(const Item &key, Page *page) {
   auto branchElements = page->getBranchPageElement(0);
   bool found = false;
-  auto index = binarySearchBranch(branchElements, key, page->count, found);
+  Item suffix;
+  auto cmp = stripPrefix(page->prefix(), key, suffix);
+  uint32_t index = cmp < 0 ? 0 : page->count;
+  if (cmp == 0) {
+    index = binarySearchBranch(branchElements, suffix, page->count, found);
+  }
   if (!found && index > 0) {
     index--;
   }
@@ -90,7 +116,8 @@ void Cursor::searchBranchPage(const Item &key, Page *page) {
   search(key, branchElements[index].pageId);
 }
 
-void *Cursor::do_seek(Item searchKey, Item &key, Item &value, uint32_t &flag) {
+void *Cursor::do_seek(const Item &searchKey, Item &key, Item &value,
+                      uint32_t &flag) {
   clearElements();
   search(searchKey, bucket_->getRootPage());
 
@@ -109,7 +136,19 @@ void *Cursor::seek(const Item &searchKey, Item &key, Item &value,
   key.reset();
   value.reset();
   flag = 0;
-  return do_seek(searchKey, key, value, flag);
+  auto ret = do_seek(searchKey, key, value, flag);
+  recordRead(searchKey, key, key);
+  return ret;
+}
+
+// hi为空表示读到了最后
+void Cursor::recordRead(const Item &lo, const Item &hi, const Item &pos) {
+  auto conflicts = bucket_->getTx()->conflicts_;
+  if (conflicts == nullptr) {
+    return;
+  }
+  conflicts->addRead(bucket_->getPath(), lo, hi, hi.empty());
+  pos_ = pos;
 }
 
 //  returns the leaf node that the cursor is currently positioned on.
@@ -156,24 +195,26 @@ void *Cursor::keyValue(Item &key, Item &value, uint32_t &flag) {
     return nullptr;
   }
 
-  auto ref = elements_.top();
+  auto &ref = elements_.top();
   if (ref.count() == 0 || ref.index_ >= ref.count()) {
     LOG(ERROR) << "get Key/value from empty bucket_ / index out of range";
     return nullptr;
   }
 
   // are those values sitting a node?
+  // inodes may move when the node changes, so these are copies
   if (ref.node_) {
-    auto inode = ref.node_->getInode(ref.index_);
+    auto &inode = ref.node_->getInode(ref.index_);
     key = inode.key;
     value = inode.value;
     flag = inode.flag;
     return nullptr;
   }
 
-  // let's get them from page
+  // let's get them from page, the items reference the page directly unless
+  // the key has to be put back together with the page's prefix
   auto ret = ref.page_->getLeafPageElement(ref.index_);
-  key = ret->key();
+  key = ref.page_->fullKey(ret->keyPtr(), ret->ksize);
   value = ret->value();
   flag = ret->flag;
   return ref.page_->getLeafPageKeyElementPtr(ref.index_);
@@ -187,9 +228,11 @@ uint32_t Cursor::binarySearchLeaf(leafPageElement *arr, const Item &key,
   uint32_t mid = (begin + end) / 2;
   while (begin < end) {
     mid = (begin + end) / 2;
-    if (arr[mid].key() > key) {
+    // compare in place, key() would copy the key out of the page
+    int cmp = compareKey(arr[mid].keyPtr(), arr[mid].ksize, key);
+    if (cmp > 0) {
       end = mid;
-    } else if (arr[mid].key() == key) {
+    } else if (cmp == 0) {
       found = true;
       return mid;
     } else {
@@ -209,9 +252,11 @@ uint32_t Cursor::binarySearchBranch(branchPageElement *arr, const Item &key,
   uint32_t mid = (begin + end) / 2;
   while (begin < end) {
     mid = (begin + end) / 2;
-    if (arr[mid].key().data_ > key.data_) {
+    // compare in place, key() would copy the key out of the page
+    int cmp = compareKey(arr[mid].keyPtr(), arr[mid].ksize, key);
+    if (cmp > 0) {
       end = mid;
-    } else if (arr[mid].key().data_ == key.data_) {
+    } else if (cmp == 0) {
       found = true;
       return mid;
     } else {
@@ -236,12 +281,14 @@ void Cursor::prev(Item &key, Item &value) {
   }
 
   if (elements_.empty()) {
+    recordRead(Item(), pos_, Item());
     return;
   }
 
   do_last();
   uint32_t flag = 0;
   keyValue(key, value, flag);
+  recordRead(key, pos_, key);
 }
 
 void Cursor::next(Item &key, Item &value) {
@@ -249,6 +296,7 @@ void Cursor::next(Item &key, Item &value) {
   value.reset();
   uint32_t flag = 0;
   do_next(key, value, flag);
+  recordRead(pos_, key, key);
 }
 
 void Cursor::last(Item &key, Item &value) {
@@ -264,6 +312,7 @@ void Cursor::last(Item &key, Item &value) {
   do_last();
   uint32_t flag = 0;
   keyValue(key, value, flag);
+  recordRead(key, Item(), key);
 }
 
 void Cursor::first(Item &key, Item &value) {
@@ -284,6 +333,7 @@ void Cursor::first(Item &key, Item &value) {
   }
 
   keyValue(key, value, flag);
+  recordRead(Item(), key, key);
 }
 
 void Cursor::do_next(Item &key, Item &value, uint32_t &flag) {
@@ -385,10 +435,34 @@ int Cursor::remove() {
     return -1;
   }
 
+  bucket_->recordWrite(false);
   getNode()->del(key);
+  auto conflicts = bucket_->getTx()->conflicts_;
+  if (conflicts != nullptr) {
+    conflicts->addWrite(WriteOp::Remove, bucket_->getPath(), key);
+  }
   return 0;
 }
 
+bool Cursor::afterLast() const {
+  if (elements_.empty()) {
+    return false;
+  }
+  auto elements = elements_;
+  if (elements.top().index_ < elements.top().count()) {
+    return false;
+  }
+  elements.pop();
+  // 上面每一层都在最后一个子节点上
+  while (!elements.empty()) {
+    if (elements.top().index_ + 1 < elements.top().count()) {
+      return false;
+    }
+    elements.pop();
+  }
+  return true;
+}
+
 void Cursor::clearElements() {
   while (!elements_.empty()) {
     elements_.pop();
@@ -3,6 +3,7 @@
 
 #include "type.h"
 #include <stack>
+#include <vector>
 
 class Page;
 class Bucket;
@@ -36,7 +37,8 @@ public:
   // weird function signature
   // return kv of the search Key if searchkey exists
   // or return the next Key
-  void *do_seek(Item searchKey, Item &key, Item &value, uint32_t &flag);
+  void *do_seek(const Item &searchKey, Item &key, Item &value,
+                uint32_t &flag);
   // Seek moves the cursor to a given key and returns it.
   // If the key does not exist then the next key is used. If no keys
   // follow, a nil key is returned.
@@ -45,6 +47,8 @@ public:
 
   // return the node the cursor is currently on
   NodePtr getNode();
+  // do_seek之后游标是否停在整个bucket最后一个key的后面
+  bool afterLast() const;
 
   void do_next(Item &key, Item &value, uint32_t &flag);
 
@@ -61,8 +65,12 @@ public:
                               int count, bool &found);
 
 private:
+  // 乐观写事务里记下这次移动读过的[lo, hi]，pos_是移动后的位置
+  void recordRead(const Item &lo, const Item &hi, const Item &pos);
+
   Bucket *bucket_;
-  std::stack<ElementRef> elements_;
+  std::stack<ElementRef, std::vector<ElementRef> > elements_;
+  Item pos_; // 只有乐观写事务才维护，为空表示不在任何key上
 };
 
 #endif // CURSOR_H_
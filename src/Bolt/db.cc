@@ -12,40 +12,62 @@
 #include <utility>
 #include <sys/mman.h>
 #include <limits.h>
+#include <thread>
 
-const uint64_t MAXMAPSIZE = 0x7FFFFFFF; // 2GB on x86
-// const uint64_t MAXMAPSIZE = 0xFFFFFFFFFFFF; // 256TB on x86_64
+// const uint64_t MAXMAPSIZE = 0x7FFFFFFF; // 2GB on x86
+const uint64_t MAXMAPSIZE = 0xFFFFFFFFFFFF; // 256TB on x86_64
 // const uint64_t MAXALLOCSIZE = 0xFFFFFFF;  // used on x86
 const uint64_t MAXALLOCSIZE = 0x7FFFFFFF; // on x86_64 used when creating
 // array pointers x86/x86_64 will not break on unaligned load/store
-constexpr int DEFAULTALLOCSIZE = 16 * 1024 * 1024;
+constexpr uint64_t DEFAULTALLOCSIZE = 16 * 1024 * 1024;
 
-constexpr uint64_t MAXMMAPSTEP = 1 << 30; // 1GB used when remapping the mmap
+constexpr uint64_t MAXMMAPSTEP = 1ULL << 30; // 1GB used when remapping the mmap
 const int DEFAULTMAXBATCHSIZE = 1000;
 constexpr int DEFAULTMAXBATCHDELAY = 10; // 单位ms
+// batch中失败的调用要单独重试
+constexpr int BATCHTRYSOLO = 1;
+// 乐观事务读过的key在提交前被改了，要用新的快照重新执行
+constexpr int TXCONFLICT = 2;
+constexpr int OPTIMISTICRETRIES = 8;
 const uint32_t MAGIC = 0xED0CDAED;
-const int VERSION = 1;
 constexpr int DEFAULTPAGESIZE = 4096;
-uint32_t MAXOBJPOOLSIZE = 10240;
 
 bool meta::validate() {
-  if (this->magic_ != MAGIC || this->version_ != VERSION) {
+  // 老版本的页都能读，写meta时升级到VERSION
+  if (this->magic_ != MAGIC || this->version_ == 0 ||
+      this->version_ > VERSION) {
     return false;
   }
-  return checksum_ != 0 ? checksum_ == sum64() : true;
+  // 只有版本1的db文件可能是加校验和之前写的，之后的版本校验和必须对得上
+  if (checksum_ == 0 && version_ == 1) {
+    return true;
+  }
+  return checksum_ == sum64();
 }
 
 DB::DB(const string &path)
-    : StrictMode_(false), NoSync_(false), NoGrowSync_(false), path_(path),
-      file_(0), lock_file_(path_ + "_lock"), dataref_(nullptr), data_(nullptr),
-      freeList_(new freeList()), bucketPool_(MAXOBJPOOLSIZE),
-      cursorPool_(MAXOBJPOOLSIZE), nodePool_(MAXOBJPOOLSIZE), batchMu_(),
-      rwLock_(), metaLock_(), mmapLock_(), statLock_(), readOnly_(false) {
-  assert(pthread_rwlock_init(&mmapLock_, NULL) == 0);
+    : StrictMode_(false), NoSync_(false), NoGrowSync_(false),
+      NoFreelistSync_(false), SingleSyncCommit_(false), MmapReserveSize_(0),
+      path_(path), file_(0), directFile_(-1), lock_file_(path_ + "_lock"),
+      dataref_(nullptr), data_(nullptr), datasz_(0), reservedsz_(0),
+      rejectedMeta_(0, 0),
+      freeList_(new freeList()), batchMu_(), batch_(nullptr),
+      runningBatches_(0), growFileMu_(), growMu_(), growCond_(), growTarget_(0),
+      stopGrow_(false), PipelinedCommit_(false), pendingMeta_(nullptr),
+      stopSync_(false), syncFailed_(false), durableTxid_(UINT64_MAX),
+      freeListMu_(), nextPgid_(0), bucketLocksMu_(), bucketLocks_(),
+      groupMu_(), groupCond_(), groupQueue_(), groupLeader_(false),
+      occActive_(0), occLeader_(false), rwLock_(), metaLock_(), mmapLock_(),
+      statLock_(), readOnly_(false) {
+  // 不能放在assert里，-DNDEBUG时不会执行
+  if (pthread_rwlock_init(&mmapLock_, NULL) != 0) {
+    LOG(ERROR) << "init mmap lock failed!";
+  }
 }
 
 DB::~DB() {
   DbClose();
+  delete freeList_;
   pthread_rwlock_destroy(&mmapLock_);
 }
 
@@ -61,13 +83,19 @@ int DB::Open(const Options &options) {
   }
 
   opened_ = true;
+  nextPgid_ = 0;
   NoGrowSync_ = options.NoGrowSync;
+  NoFreelistSync_ = options.NoFreelistSync;
+  SingleSyncCommit_ = options.SingleSyncCommit;
   MmapFlags_ = options.MmapFlags;
-  MaxBatchSize_ = DEFAULTMAXBATCHSIZE;
-  MaxBatchDelay_ = DEFAULTMAXBATCHDELAY;
-  AllocSize_ = DEFAULTALLOCSIZE;
+  MaxBatchSize_ =
+      options.MaxBatchSize > 0 ? options.MaxBatchSize : DEFAULTMAXBATCHSIZE;
+  MaxBatchDelay_ = options.MaxBatchDelay > 0 ? options.MaxBatchDelay
+                                             : DEFAULTMAXBATCHDELAY;
+  AllocSize_ = options.AllocSize > 0 ? options.AllocSize : DEFAULTALLOCSIZE;
+  MmapReserveSize_ = std::min(options.MmapReserveSize, MAXMAPSIZE);
 
-  int flag = O_CREAT; //  | O_DIRECT
+  int flag = O_CREAT; // O_DIRECT见Options::DirectIO
   if (options.ReadOnly) {
     readOnly_ = true;
     flag |= O_RDONLY;
@@ -79,6 +107,25 @@ int DB::Open(const Options &options) {
     LOG(ERROR) << "open file failed!";
     return -1;
   }
+  // O_DIRECT只用于提交时写页，mmap、ftruncate和初始化还是走file_
+  auto writeFd = file_;
+  if (options.DirectIO && !readOnly_) {
+    directFile_ = ::open(path_.c_str(), O_RDWR | O_DIRECT);
+    if (directFile_ == -1) {
+      LOG(WARNING) << "open file with O_DIRECT failed, errno: " << errno;
+    } else {
+      writeFd = directFile_;
+    }
+  }
+  if (options.IoUring) {
+    writer_ = UringWriter::create(writeFd);
+    if (!writer_) {
+      LOG(WARNING) << "io_uring not available, fall back to pwritev";
+    }
+  }
+  if (!writer_) {
+    writer_.reset(new SyncWriter(writeFd));
+  }
   filesz_ = GetFileSize(file_);
   if (filesz_ == 0) {
     // first time to init a DB
@@ -96,10 +143,11 @@ int DB::Open(const Options &options) {
     return -1;
   }
   auto m = reinterpret_cast<meta *>(pageInBuffer(buf, sizeof(buf), 0)->ptr);
+  // meta0可能被清掉了(见下面的verifyMetaPages)，这时按系统页大小找meta1
   if (m->validate()) {
-    pageSize_ = DEFAULTPAGESIZE;
-  } else {
     pageSize_ = m->pageSize_;
+  } else {
+    pageSize_ = getpagesize();
   }
   if (initMeta(options.InitialMMapSize) == -1) {
     LOG(ERROR) << "init Meta failed!";
@@ -107,38 +155,239 @@ int DB::Open(const Options &options) {
     return -1;
   }
 
-  freeList_->read(getPagePtr(getMeta()->freeListPageNumber_));
+  // 最新的meta如果是单次落盘提交写的，它引用的页可能没有完整落盘
+  auto newest = meta0_->txid_ > meta1_->txid_ ? meta0_ : meta1_;
+  if (newest->validate() && !verifyMetaPages(newest)) {
+    LOG(WARNING) << "pages of meta txid " << newest->txid_
+                 << " are incomplete, fall back to the previous meta";
+    auto other = newest == meta0_ ? meta1_ : meta0_;
+    if (!other->validate()) {
+      LOG(ERROR) << "no valid meta left!";
+      DbClose();
+      return -1;
+    }
+    if (readOnly_) {
+      rejectedMeta_.first = newest->txid_;
+      rejectedMeta_.second = newest->checksum_;
+    } else {
+      // 清掉这个meta，下一次提交会重新写这个位置。下一次提交可能分配到相同的页，
+      // 写出和它一模一样的meta，所以不能只在内存里按内容排除
+      std::vector<char> zero(pageSize_, 0);
+      off_t offset = (newest == meta0_ ? 0 : 1) * pageSize_;
+      if (writeAt(zero.data(), zero.size(), offset) !=
+              static_cast<ssize_t>(zero.size()) ||
+          !fileSync()) {
+        LOG(ERROR) << "clear incomplete meta failed!";
+        DbClose();
+        return -1;
+      }
+    }
+  }
+
+  if (getMeta() == nullptr) {
+    DbClose();
+    return -1;
+  }
+  if (hasSyncedFreelist()) {
+    freeList_->read(getPagePtr(getMeta()->freeListPageNumber_));
+  } else if (!readOnly_) {
+    freeList_->readIds(freePages());
+  }
+
+  if (options.PreGrow && !readOnly_ && !NoGrowSync_) {
+    stopGrow_ = false;
+    growThread_ = std::thread(&DB::preGrowLoop, this);
+  }
+  PipelinedCommit_ = options.PipelinedCommit && !readOnly_;
+  if (PipelinedCommit_) {
+    durableTxid_ = getMeta()->txid_;
+    stopSync_ = false;
+    syncFailed_ = false;
+    syncThread_ = std::thread(&DB::syncLoop, this);
+  }
   return 0;
 }
 
-meta *DB::getMeta() {
-  auto m0 = meta0_;
-  auto m1 = meta1_;
-  if (m0->txid_ < m1->txid_) {
-    m0 = meta1_;
-    m1 = meta0_;
+// 记录page自己占用的页，下一层要访问的页(branch的子节点，leaf中非inline子bucket的根)
+// 放进children
+static void walkPage(DB *db, pgid id, std::vector<pgid> *reachable,
+                     std::vector<pgid> *children) {
+  auto p = db->getPagePtr(id);
+  for (pgid i = id; i <= id + p->overflow; i++) {
+    reachable->push_back(i);
+  }
+  if (p->flag & pageFlags::branchPageFlag) {
+    for (uint32_t i = 0; i < p->count; i++) {
+      children->push_back(p->getBranchPageElement(i)->pageId);
+    }
+  } else if (p->flag & pageFlags::leafPageFlag) {
+    for (uint32_t i = 0; i < p->count; i++) {
+      auto element = p->getLeafPageElement(i);
+      if (!(element->flag & bucketLeafFlag)) {
+        continue;
+      }
+      bucketHeader header;
+      memcpy(&header, element->valuePtr(), sizeof(header));
+      // inline bucket没有自己的页
+      if (header.root != 0) {
+        children->push_back(header.root);
+      }
+    }
+  }
+}
+
+std::vector<pgid> DB::freePages() {
+  auto m = getMeta();
+  if (m == nullptr) {
+    return std::vector<pgid>();
+  }
+  std::vector<pgid> reachable;
+  std::vector<pgid> frontier{ m->root_.root };
+  // 先在当前线程按层展开，子树足够多了再分给多个线程各自深度优先遍历
+  uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+  while (!frontier.empty() && frontier.size() < threads * 4) {
+    std::vector<pgid> next;
+    for (auto id : frontier) {
+      walkPage(this, id, &reachable, &next);
+    }
+    frontier.swap(next);
+  }
+
+  std::vector<std::vector<pgid> > results(threads);
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads && t < frontier.size(); t++) {
+    workers.emplace_back([this, t, threads, &frontier, &results]() {
+      std::vector<pgid> stack;
+      for (size_t i = t; i < frontier.size(); i += threads) {
+        stack.push_back(frontier[i]);
+      }
+      while (!stack.empty()) {
+        auto id = stack.back();
+        stack.pop_back();
+        walkPage(this, id, &results[t], &stack);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
   }
-  if (m0->validate()) {
-    return m0;
+
+  std::vector<bool> used(m->totalPageNumber_, false);
+  used[0] = used[1] = true;
+  if (m->freeListPageNumber_ != PGIDNOFREELIST) {
+    auto p = getPagePtr(m->freeListPageNumber_);
+    for (pgid i = p->id; i <= p->id + p->overflow; i++) {
+      used[i] = true;
+    }
+  }
+  results.push_back(std::move(reachable));
+  for (auto &result : results) {
+    for (auto id : result) {
+      if (id < used.size()) {
+        used[id] = true;
+      }
+    }
   }
-  if (m1->validate()) {
-    return m1;
+  std::vector<pgid> ids;
+  for (pgid i = 2; i < used.size(); i++) {
+    if (!used[i]) {
+      ids.push_back(i);
+    }
+  }
+  return ids;
+}
+
+meta *DB::getMeta() {
+  // PipelinedCommit时同步线程写了还没fdatasync的meta也跳过。读了durableTxid_之后同步线程
+  // 可能又落盘了一次并开始写下一个，覆盖了当时落盘的那一页，两页都比它新，这时重新读
+  auto durable = durableTxid_.load();
+  while (true) {
+    auto m0 = meta0_;
+    auto m1 = meta1_;
+    if (m0->txid_ < m1->txid_) {
+      m0 = meta1_;
+      m1 = meta0_;
+    }
+    auto rejected = [this, durable](meta *m) {
+      return (m->txid_ == rejectedMeta_.first &&
+              m->checksum_ == rejectedMeta_.second) ||
+             m->txid_ > durable;
+    };
+    if (m0->validate() && !rejected(m0)) {
+      return m0;
+    }
+    if (m1->validate() && !rejected(m1)) {
+      return m1;
+    }
+    auto latest = durableTxid_.load();
+    if (latest == durable) {
+      break;
+    }
+    durable = latest;
   }
-  assert(false);
+  LOG(ERROR) << "no valid meta!";
   return nullptr;
 }
 
-int DB::initMeta(uint32_t InitialMMapSize) {
-  assert(getMmapWLock());
+meta *DB::cloneMeta() {
+  // 同步线程可能正在把下一个meta写到这一页上：拷贝出来的校验和对不上，或者拷到的是
+  // 刚写完还没落盘的meta，都重新取
+  while (true) {
+    auto m = getMeta();
+    if (m == nullptr) {
+      return nullptr;
+    }
+    auto copy = m->clone();
+    if (copy->validate() && copy->txid_ <= durableTxid_) {
+      return copy;
+    }
+    delete copy;
+  }
+}
+
+bool DB::verifyMetaPages(meta *m) {
+  if (!(m->flags_ & METASINGLESYNC)) {
+    return true;
+  }
+  auto record = reinterpret_cast<metaPageRecord *>(m + 1);
+  auto capacity = (pageSize_ - PAGEHEADERSIZE - sizeof(meta) -
+                   sizeof(metaPageRecord)) / sizeof(pageExtent);
+  if (record->count > capacity) {
+    return false;
+  }
+  uint64_t sum =
+      checksum64(record->extents, record->count * sizeof(pageExtent));
+  for (uint32_t i = 0; i < record->count; i++) {
+    auto &extent = record->extents[i];
+    uint64_t end = extent.id + extent.count;
+    // 文件可能还没有长到这里
+    if (end > m->totalPageNumber_ || end * pageSize_ > filesz_ ||
+        end * pageSize_ > datasz_) {
+      return false;
+    }
+    sum = checksum64(getPagePtr(extent.id),
+                     static_cast<size_t>(extent.count) * pageSize_, sum);
+  }
+  return sum == record->checksum;
+}
+
+int DB::initMeta(uint64_t InitialMMapSize) {
   if (filesz_ < pageSize_ * 2) {
-    unlockMmapLock();
     return -1;
   }
   LOG(INFO) << "initMeta filesz_= " << filesz_;
-  auto targetSize = std::max(filesz_, InitialMMapSize);
+  auto targetSize = std::max(filesz_.load(), InitialMMapSize);
   if (getMmapSize(targetSize) != 0) {
     LOG(ERROR) << "get Mmap file size failed!";
-    unlockMmapLock();
+    return -1;
+  }
+  // 预留的地址空间还够用时原地扩展，映射地址不变，不需要等读事务结束
+  if (extendMmap(targetSize)) {
+    return 0;
+  }
+
+  if (!getMmapWLock()) {
+    LOG(ERROR) << "get mmap write lock failed!";
     return -1;
   }
 
@@ -175,7 +424,10 @@ Page *DB::getPagePtr(pgid pgid) {
   return reinterpret_cast<Page *>(&data_[pgid * pageSize_]);
 }
 
-bool DB::mmapDbFile(int targetSize) {
+bool DB::mmapDbFile(uint64_t targetSize) {
+  if (MmapReserveSize_ > 0) {
+    return reserveMmap(targetSize);
+  }
   void *ptr = ::mmap(nullptr, targetSize, PROT_READ, MAP_SHARED, file_, 0);
   if (ptr == MAP_FAILED) {
     return false;
@@ -192,7 +444,8 @@ bool DB::DbMunmap() {
     return true;
   }
   LOG(INFO) << "current dataref_: " << dataref_;
-  int ret = ::munmap(dataref_, datasz_);
+  int ret =
+      ::munmap(dataref_, reservedsz_ > 0 ? reservedsz_ : datasz_.load());
   if (ret == -1) {
     LOG(ERROR) << "munmap failed!";
     return false;
@@ -200,37 +453,128 @@ bool DB::DbMunmap() {
   data_ = nullptr;
   dataref_ = nullptr;
   datasz_ = 0;
+  reservedsz_ = 0;
+  return true;
+}
+
+bool DB::reserveMmap(uint64_t targetSize) {
+  // 预留的大小取页大小的整数倍，不够映射当前文件时按targetSize的两倍预留
+  auto size = (MmapReserveSize_ + pageSize_ - 1) / pageSize_ * pageSize_;
+  if (size < targetSize) {
+    size = std::min(targetSize * 2, MAXMAPSIZE);
+  }
+  void *base = ::mmap(nullptr, size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    LOG(ERROR) << "reserve address space failed, size: " << size;
+    return false;
+  }
+  void *ptr = ::mmap(base, targetSize, PROT_READ, MAP_SHARED | MAP_FIXED,
+                     file_, 0);
+  if (ptr == MAP_FAILED) {
+    ::munmap(base, size);
+    return false;
+  }
+  ::madvise(ptr, targetSize, MADV_RANDOM);
+  data_ = reinterpret_cast<decltype(data_)>(ptr);
+  dataref_ = ptr;
+  datasz_ = targetSize;
+  reservedsz_ = size;
+  return true;
+}
+
+bool DB::extendMmap(uint64_t targetSize) {
+  if (reservedsz_ == 0 || targetSize > reservedsz_) {
+    return false;
+  }
+  if (targetSize <= datasz_) {
+    return true;
+  }
+  // MAP_FIXED原子地替换预留区间里[datasz_, targetSize)这一段，前面已经映射的部分不受影响，
+  // 读事务可以继续访问。datasz_是页大小的整数倍，可以直接作为文件偏移
+  void *ptr = ::mmap(data_ + datasz_, targetSize - datasz_, PROT_READ,
+                     MAP_SHARED | MAP_FIXED, file_, datasz_);
+  if (ptr == MAP_FAILED) {
+    LOG(ERROR) << "extend mmap failed!";
+    return false;
+  }
+  ::madvise(ptr, targetSize - datasz_, MADV_RANDOM);
+  datasz_ = targetSize;
   return true;
 }
 
 // mmapSize determines the appropriate size for the mmap given the current size
 // of the database. The minimum size is 32KB and doubles until it reaches 1GB.
+// After that it grows by MAXMMAPSTEP at a time.
 // Returns an error if the new mmap size is greater than the max allowed.
-int DB::getMmapSize(uint32_t &targetSize) {
+int DB::getMmapSize(uint64_t &targetSize) {
   // from 32k up to 1G
   LOG(INFO) << "mmap target size = " << targetSize;
   for (int i = 15; i <= 30; i++) {
-    if (targetSize <= (1UL << i)) {
-      targetSize = 1UL << i;
+    if (targetSize <= (1ULL << i)) {
+      targetSize = 1ULL << i;
       return 0;
     }
   }
   if (targetSize > MAXMAPSIZE) {
+    LOG(ERROR) << "mmap too large: " << targetSize;
     return -1;
   }
-  assert(false);
+  // 超过1GB之后每次按1GB增长
+  auto remainder = targetSize % MAXMMAPSTEP;
+  if (remainder > 0) {
+    targetSize += MAXMMAPSTEP - remainder;
+  }
+  // mmap的大小必须是页大小的整数倍
+  if (targetSize % pageSize_ != 0) {
+    targetSize = (targetSize / pageSize_ + 1) * pageSize_;
+  }
+  if (targetSize > MAXMAPSIZE) {
+    targetSize = MAXMAPSIZE;
+  }
+  return 0;
 }
 
 void DB::DbClose() {
-  std::lock_guard<std::mutex> guard1(rwLock_);
+  std::lock_guard<std::shared_timed_mutex> guard1(rwLock_);
   std::lock_guard<std::mutex> guard2(metaLock_);
-  getMmapRLock();
+  // 等读事务都结束之后再解除映射
+  getMmapWLock();
 
   if (!opened_) {
+    unlockMmapLock();
     return;
   }
   opened_ = false;
+  if (growThread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(growMu_);
+      stopGrow_ = true;
+    }
+    growCond_.notify_one();
+    growThread_.join();
+  }
+  if (syncThread_.joinable()) {
+    // 同步线程把队列里的提交都落盘之后才退出
+    {
+      std::lock_guard<std::mutex> guard(syncMu_);
+      stopSync_ = true;
+    }
+    syncCond_.notify_one();
+    syncThread_.join();
+    delete pendingMeta_;
+    pendingMeta_ = nullptr;
+    durableTxid_ = UINT64_MAX;
+  }
   freeList_->reset();
+  if (!DbMunmap()) {
+    LOG(ERROR) << "un-map file failed upon close db!";
+  }
+  writer_.reset();
+  if (directFile_ != -1) {
+    close(directFile_);
+    directFile_ = -1;
+  }
   if (file_) {
     close(file_);
     file_ = -1;
@@ -258,7 +602,7 @@ int DB::Init() {
     m->root_ = bucketHeader{ 3, 0 };
     m->totalPageNumber_ = 4;
     m->txid_ = i;
-    m->checksum_ = 0; // TODO(roland):checksum
+    m->checksum_ = m->sum64();
   }
 
   // free list
@@ -290,44 +634,83 @@ Page *DB::pageInBuffer(char *ptr, size_t length, pgid pageId) {
   return reinterpret_cast<Page *>(ptr + pageId * pageSize_);
 }
 
-Page *DB::allocate(uint32_t numPages, TxPtr tx) {
+Page *DB::allocate(uint32_t numPages, Tx *tx) {
   uint32_t len = numPages * pageSize_;
   assert(numPages < 0x1000);
   LOG(INFO) << "allocating len: " << len;
-  // 操作在内存，现在不持久化
-  auto ptr = reinterpret_cast<Page *>(new char[len]); // TODO(roland): mempool
+  // 操作在内存，现在不持久化。dirty page随事务的内存池一起释放
+  auto ptr =
+      reinterpret_cast<Page *>(tx->pool_.allocate(len, pageAlignment()));
+  memset(ptr, 0, len);
   ptr->overflow = numPages - 1;
+  std::lock_guard<std::recursive_mutex> guard(freeListMu_);
+  auto m = tx->getMeta();
   pgid pg = freeList_->allocate(numPages);
   if (pg != 0) {
     ptr->id = pg;
+    // 可能是别的事务在这个事务开始之后放回来的页
+    m->totalPageNumber_ = std::max(m->totalPageNumber_, pg + numPages);
     return ptr;
   }
   // need to expand mmap file here
   LOG(INFO) << "not free Page, try to mmap new Page!";
-  ptr->id = rwtx_->getMeta()->totalPageNumber_;
-  int minLen = (ptr->id + numPages + 1) * pageSize_;
-  if (minLen > datasz_) {
+  ptr->id = std::max(m->totalPageNumber_, nextPgid_);
+  uint64_t minLen = (ptr->id + numPages + 1) * pageSize_;
+  if (minLen > datasz_ && tx->concurrent_) {
+    // 别的写事务还在用映射，只能在预留的地址空间里原地扩展
+    auto targetSize = minLen;
+    if (getMmapSize(targetSize) != 0 || !extendMmap(targetSize)) {
+      LOG(WARNING) << "mmap reservation exhausted, size: " << minLen;
+      tx->needRemap_ = true;
+      return nullptr;
+    }
+  } else if (minLen > datasz_) {
     struct stat stat1;
     {
       auto ret = fstat(file_, &stat1);
       if (ret == -1) {
         LOG(FATAL) << "syscall fstat failed!";
-        delete ptr;
         return nullptr;
       }
     }
     if (initMeta(minLen)) {
       LOG(ERROR) << "reallocate file initMeta failed!";
-      delete ptr;
       return nullptr;
     }
   }
 
-  rwtx_->getMeta()->totalPageNumber_ += numPages;
+  nextPgid_ = ptr->id + numPages;
+  m->totalPageNumber_ = nextPgid_;
   LOG(INFO) << "allocate more page successed!";
   return ptr;
 }
 
+void DB::unallocate(Page *page, Tx *tx) {
+  std::lock_guard<std::recursive_mutex> guard(freeListMu_);
+  pgid id = page->id;
+  uint32_t count = page->overflow + 1;
+  // 别的写事务不会同时从文件末尾分配，最后分配的页直接退回到末尾
+  if (!tx->concurrent_ && id + count == nextPgid_) {
+    nextPgid_ = id;
+    tx->getMeta()->totalPageNumber_ = id;
+    return;
+  }
+  freeList_->unallocate(id, count);
+}
+
+pgid DB::getNextPgid() {
+  std::lock_guard<std::recursive_mutex> guard(freeListMu_);
+  return nextPgid_;
+}
+
+void DB::resetNextPgid() {
+  std::lock_guard<std::recursive_mutex> guard(freeListMu_);
+  auto m = getMeta();
+  if (m != nullptr) {
+    nextPgid_ = m->totalPageNumber_;
+  }
+}
+
 int DB::update(std::function<int(TxPtr tx)> fn) {
   TxPtr tx = beginRWTx();
   if (tx == nullptr) {
@@ -340,18 +723,542 @@ int DB::update(std::function<int(TxPtr tx)> fn) {
   if (ret != 0) {
     LOG(ERROR) << "user intput returned false!";
     tx->rollback();
+    closeTx(tx);
     return -1;
   }
 
+  tx->pipelined_ = PipelinedCommit_;
   auto result = tx->commit();
   closeTx(tx);
+  if (result == 0 && tx->pipelined_) {
+    // 写锁已经放开，下一个写事务和这次的落盘同时进行
+    result = tx->pipelineResult_.get();
+    if (result == 0) {
+      for (auto &item : tx->commitHandlers_) {
+        item();
+      }
+    }
+  }
   return result;
 }
 
+int DB::updateBuckets(const std::vector<std::string> &names,
+                      std::function<int(TxPtr tx)> fn) {
+  std::vector<std::string> sorted(names);
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+  std::shared_lock<std::shared_timed_mutex> shared(rwLock_);
+  // 快照和写事务的meta要一致，等流水线里的提交落盘
+  drainCommits();
+  // 持有共享锁时没有普通写事务，映射不会被替换
+  if (readOnly_ || reservedsz_ == 0 || sorted.empty()) {
+    shared.unlock();
+    return update(fn);
+  }
+  // 按名字的顺序加锁，不会死锁
+  std::vector<std::unique_lock<std::mutex> > locks;
+  for (auto &name : sorted) {
+    locks.emplace_back(*bucketLock(name));
+  }
+  TxPtr tx = beginBucketTx(sorted);
+  if (tx == nullptr) {
+    LOG(ERROR) << "construct bucket transaction failed!";
+    return -1;
+  }
+  tx->managed_ = true;
+  int ret = fn(tx);
+  tx->managed_ = false;
+  if (ret != 0) {
+    LOG(ERROR) << "user intput returned false!";
+    tx->rollback();
+    closeTx(tx);
+    return -1;
+  }
+  ret = tx->commit();
+  bool remap = tx->needRemap_;
+  closeTx(tx);
+  if (ret != 0 && remap) {
+    // 预留的地址空间用完了，由update重新映射
+    locks.clear();
+    shared.unlock();
+    LOG(WARNING) << "retry bucket transaction with update";
+    return update(fn);
+  }
+  return ret;
+}
+
+meta *DB::cloneWriterMeta() {
+  std::lock_guard<std::mutex> guard(syncMu_);
+  return pendingMeta_ != nullptr ? pendingMeta_->clone() : cloneMeta();
+}
+
+int DB::queueCommit(Tx *tx) {
+  pipelinedCommit commit;
+  commit.id = tx->getTxId();
+  void *buf = nullptr;
+  if (posix_memalign(&buf, pageAlignment(), pageSize_) != 0) {
+    LOG(ERROR) << "allocate meta page failed!";
+    return -1;
+  }
+  memset(buf, 0, pageSize_);
+  commit.metaPage.reset(static_cast<char *>(buf));
+  tx->getMeta()->flags_ &= ~METASINGLESYNC;
+  tx->getMeta()->write(reinterpret_cast<Page *>(commit.metaPage.get()));
+  tx->pipelineResult_ = commit.result.get_future();
+  std::lock_guard<std::mutex> guard(syncMu_);
+  if (syncFailed_) {
+    LOG(ERROR) << "a previous pipelined commit failed, reopen the db";
+    return -1;
+  }
+  delete pendingMeta_;
+  pendingMeta_ = tx->getMeta()->clone();
+  syncQueue_.push_back(std::move(commit));
+  syncCond_.notify_one();
+  return 0;
+}
+
+void DB::drainCommits() {
+  if (!PipelinedCommit_) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(syncMu_);
+  durableCond_.wait(lock, [this] { return syncQueue_.empty(); });
+}
+
+void DB::setDurableTxid(txid id) {
+  if (PipelinedCommit_) {
+    durableTxid_ = id;
+  }
+}
+
+void DB::syncLoop() {
+  std::unique_lock<std::mutex> lock(syncMu_);
+  while (true) {
+    syncCond_.wait(lock, [this] { return stopSync_ || !syncQueue_.empty(); });
+    if (syncQueue_.empty()) {
+      return;
+    }
+    // 队列里的txid从durableTxid_ + 1开始连续。meta不能写到最新的落盘的meta那一页上，
+    // 否则fdatasync之前读事务两页都用不了，所以最后一个和它同一页时先落盘前一个
+    size_t last = syncQueue_.size() - 1;
+    if ((syncQueue_[last].id - durableTxid_) % 2 == 0) {
+      last--;
+    }
+    auto &commit = syncQueue_[last];
+    lock.unlock();
+    // 先让所有已经写完的数据页落盘，再和Tx::writeMeta一样经过writer_写meta
+    int ret = 0;
+    if (!NoSync_ && !fileSync()) {
+      ret = -1;
+    }
+    std::vector<WriteRun> runs(1);
+    runs[0].offset = (commit.id % 2) * pageSize_;
+    runs[0].length = pageSize_;
+    runs[0].iov.push_back(iovec{ commit.metaPage.get(), pageSize_ });
+    if (ret == 0 && writer_->writeRuns(runs, !NoSync_) != 0) {
+      ret = -1;
+    }
+    lock.lock();
+    if (ret != 0) {
+      LOG(ERROR) << "pipelined commit sync failed!";
+      syncFailed_ = true;
+      while (!syncQueue_.empty()) {
+        syncQueue_.front().result.set_value(-1);
+        syncQueue_.pop_front();
+      }
+    } else {
+      durableTxid_ = commit.id;
+      for (size_t i = 0; i <= last; i++) {
+        syncQueue_.front().result.set_value(0);
+        syncQueue_.pop_front();
+      }
+    }
+    if (syncQueue_.empty()) {
+      delete pendingMeta_;
+      pendingMeta_ = nullptr;
+    }
+    durableCond_.notify_all();
+  }
+}
+
+std::mutex *DB::bucketLock(const std::string &name) {
+  std::lock_guard<std::mutex> guard(bucketLocksMu_);
+  auto &lock = bucketLocks_[name];
+  if (!lock) {
+    lock.reset(new std::mutex());
+  }
+  return lock.get();
+}
+
+TxPtr DB::beginBucketTx(const std::vector<std::string> &names) {
+  getMmapRLock();
+  if (!opened_) {
+    unlockMmapLock();
+    return nullptr;
+  }
+  TxPtr tx(new Tx());
+  tx->setWriteable(true);
+  tx->concurrent_ = true;
+  for (auto &name : names) {
+    tx->bucketNames_.emplace_back(name);
+  }
+  // 和读事务一样登记快照，提交之前别的事务不会释放它读到的页
+  if (!registerReader(tx.get())) {
+    unlockMmapLock();
+    return nullptr;
+  }
+  if (tx->init(this) != 0) {
+    removeTx(tx);
+    return nullptr;
+  }
+  return tx;
+}
+
+int DB::commitGroup(Tx *tx) {
+  std::unique_lock<std::mutex> lock(groupMu_);
+  groupQueue_.push_back(tx);
+  groupCond_.wait(lock, [this, tx] { return tx->groupDone_ || !groupLeader_; });
+  if (tx->groupDone_) {
+    return tx->groupResult_;
+  }
+  // 前一组提交完了，提交期间排进来的事务都在这一组里
+  groupLeader_ = true;
+  std::vector<Tx *> group;
+  group.swap(groupQueue_);
+  lock.unlock();
+  int ret = writeGroup(group);
+  lock.lock();
+  for (auto member : group) {
+    member->groupResult_ = ret;
+    member->groupDone_ = true;
+  }
+  groupLeader_ = false;
+  groupCond_.notify_all();
+  return ret;
+}
+
+int DB::writeGroup(const std::vector<Tx *> &group) {
+  TxPtr tx(new Tx());
+  tx->setWriteable(true);
+  tx->concurrent_ = true;
+  if (tx->init(this) != 0) {
+    return -1;
+  }
+  {
+    std::lock_guard<std::recursive_mutex> guard(freeListMu_);
+    auto minId = readers_.minTxid();
+    if (minId > 0) {
+      freeList_->release(minId - 1);
+    }
+  }
+  for (auto member : group) {
+    // 声明的bucket只有这个事务在写，它的快照里的版本就是最新的，直接替换
+    for (auto &item : member->spilledBuckets_) {
+      tx->rootBucket_->putChild(item.first, item.second);
+    }
+    for (auto page : member->freed_) {
+      tx->free(tx->getTxId(), page);
+    }
+    // 页还在member的内存池里，member等到这一组提交完才会close()
+    tx->dirtyPageTable_.insert(member->dirtyPageTable_.begin(),
+                               member->dirtyPageTable_.end());
+    member->dirtyPageTable_.clear();
+    member->freed_.clear();
+  }
+  int ret = tx->commit();
+  if (ret != 0 && tx->needRemap_) {
+    for (auto member : group) {
+      member->needRemap_ = true;
+    }
+  }
+  return ret;
+}
+
+int DB::updateOptimistic(std::function<int(TxPtr tx)> fn) {
+  if (readOnly_) {
+    return -1;
+  }
+  ConflictSet conflicts;
+  for (int i = 0; i < OPTIMISTICRETRIES; i++) {
+    TxPtr tx = beginOptimisticTx(&conflicts);
+    if (tx == nullptr) {
+      LOG(ERROR) << "construct optimistic transaction failed!";
+      return -1;
+    }
+    tx->managed_ = true;
+    int ret = fn(tx);
+    tx->managed_ = false;
+    // 读写集合已经记下来了，快照不再需要，重放时可能要重新映射
+    tx->rollback();
+    closeTx(tx);
+    if (ret != 0) {
+      LOG(ERROR) << "user intput returned false!";
+      endOptimisticTx(&conflicts);
+      return -1;
+    }
+    if (conflicts.writes().empty()) {
+      // 只读的事务在快照上就是一致的
+      endOptimisticTx(&conflicts);
+      return 0;
+    }
+    ret = commitOptimistic(&conflicts);
+    endOptimisticTx(&conflicts);
+    if (ret != TXCONFLICT) {
+      return ret;
+    }
+  }
+  LOG(WARNING) << "too many conflicts, retry optimistic transaction with update";
+  return update(fn);
+}
+
+TxPtr DB::beginOptimisticTx(ConflictSet *conflicts) {
+  {
+    // 先计数再取快照，之后提交的写事务就会登记它们改过的key
+    std::lock_guard<std::mutex> guard(occMu_);
+    occActive_++;
+  }
+  TxPtr tx = beginTx();
+  if (tx == nullptr) {
+    std::lock_guard<std::mutex> guard(occMu_);
+    occActive_--;
+    return nullptr;
+  }
+  tx->setWriteable(true);
+  tx->conflicts_ = conflicts;
+  conflicts->reset(tx->getTxId());
+  std::lock_guard<std::mutex> guard(occMu_);
+  occSnapshots_.insert(conflicts->snapshot());
+  return tx;
+}
+
+void DB::endOptimisticTx(const ConflictSet *conflicts) {
+  std::lock_guard<std::mutex> guard(occMu_);
+  occActive_--;
+  occSnapshots_.erase(occSnapshots_.find(conflicts->snapshot()));
+  if (occActive_ == 0) {
+    pruneCommitted(durableTxid_);
+  }
+}
+
+void DB::recordCommit(txid id, CommittedWrites *writes) {
+  std::lock_guard<std::mutex> guard(occMu_);
+  // PipelinedCommit时还没落盘的提交不在之后的乐观事务的快照里，也要登记
+  if (occActive_ == 0 && id <= durableTxid_) {
+    return;
+  }
+  if (writes != nullptr) {
+    writes->id = id;
+    committed_.push_back(std::move(*writes));
+  } else {
+    committed_.emplace_back();
+    committed_.back().id = id;
+    committed_.back().all = true;
+  }
+  if (occActive_ == 0) {
+    pruneCommitted(durableTxid_);
+  } else if (static_cast<int>(occSnapshots_.size()) == occActive_) {
+    // 所有乐观事务的快照都确定了，比最老的快照还老的不会再用到
+    pruneCommitted(*occSnapshots_.begin());
+  }
+}
+
+void DB::pruneCommitted(txid snapshot) {
+  while (!committed_.empty() && committed_.front().id <= snapshot) {
+    committed_.pop_front();
+  }
+}
+
+int DB::commitOptimistic(ConflictSet *conflicts) {
+  optimisticCommit call{ conflicts, false, 0 };
+  std::unique_lock<std::mutex> lock(occMu_);
+  occQueue_.push_back(&call);
+  occCond_.wait(lock, [this, &call] { return call.done || !occLeader_; });
+  if (call.done) {
+    return call.result;
+  }
+  occLeader_ = true;
+  std::vector<optimisticCommit *> group;
+  group.swap(occQueue_);
+  lock.unlock();
+  replayOptimistic(group);
+  lock.lock();
+  for (auto member : group) {
+    member->done = true;
+  }
+  occLeader_ = false;
+  occCond_.notify_all();
+  return call.result;
+}
+
+void DB::replayOptimistic(const std::vector<optimisticCommit *> &group) {
+  CommittedWrites merged;
+  bool replayFailed = false;
+  int ret = update([&](TxPtr tx)->int {
+    {
+      // 持有写锁，committed_只会在这个事务提交时变化
+      std::lock_guard<std::mutex> guard(occMu_);
+      for (auto member : group) {
+        auto conflicts = member->conflicts;
+        member->result = TXCONFLICT;
+        // 同一组里先重放的事务也是在它的快照之后提交的
+        if (conflicts->conflictsWith(merged)) {
+          continue;
+        }
+        bool conflict = false;
+        for (auto &committed : committed_) {
+          if (committed.id > conflicts->snapshot() &&
+              conflicts->conflictsWith(committed)) {
+            conflict = true;
+            break;
+          }
+        }
+        if (!conflict) {
+          conflicts->mergeInto(merged);
+          member->result = 0;
+        }
+      }
+    }
+    for (auto member : group) {
+      if (member->result == 0 && replayWrites(tx.get(), *member->conflicts)) {
+        // 验证过的写重放不会失败，失败时整组重新执行
+        replayFailed = true;
+        return -1;
+      }
+    }
+    tx->replayWrites_ = &merged;
+    return 0;
+  });
+  if (ret == 0) {
+    return;
+  }
+  for (auto member : group) {
+    if (member->result == 0) {
+      member->result = replayFailed ? TXCONFLICT : -1;
+    }
+  }
+}
+
+int DB::replayWrites(Tx *tx, const ConflictSet &conflicts) {
+  const std::string *path = nullptr;
+  Bucket *bucket = nullptr;
+  for (auto &write : conflicts.writes()) {
+    if (path == nullptr || *path != write.path) {
+      path = &write.path;
+      bucket = tx->rootBucket_;
+      for (auto &name : ConflictSet::splitPath(write.path)) {
+        bucket = bucket->getBucketByName(Item(name));
+        if (bucket == nullptr) {
+          return -1;
+        }
+      }
+    }
+    int ret = 0;
+    switch (write.op) {
+    case WriteOp::Put:
+      ret = bucket->put(Item(write.key), Item(write.value));
+      break;
+    case WriteOp::Remove:
+      ret = bucket->remove(Item(write.key));
+      break;
+    case WriteOp::CreateBucket:
+      ret = bucket->createBucket(Item(write.key)) == nullptr ? -1 : 0;
+      break;
+    case WriteOp::DeleteBucket:
+      ret = bucket->deleteBucket(Item(write.key));
+      break;
+    }
+    if (ret != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// 第一个调用者新建batch，等前一个batch提交完(最多等MaxBatchDelay_)，期间其他线程的调用
+// 都加入这个batch，攒够MaxBatchSize_个也会提前开始。然后由第一个调用者在一个写事务里执行
+// 所有的fn。一个batch落盘的时候下一个batch在攒，batch的大小随落盘的耗时自动变化。
+int DB::batch(std::function<int(TxPtr tx)> fn) {
+  std::unique_lock<std::mutex> lock(batchMu_);
+  bool leader = false;
+  if (batch_ == nullptr) {
+    batch_ = new struct batch();
+    leader = true;
+  }
+  auto b = batch_;
+  b->calls.emplace_back();
+  b->calls.back().fn = fn;
+  auto result = b->calls.back().result.get_future();
+  if (static_cast<int>(b->calls.size()) >= MaxBatchSize_) {
+    // 满了，之后的调用进入新的batch
+    batch_ = nullptr;
+    b->ready.notify_one();
+  }
+
+  if (leader) {
+    b->ready.wait_for(lock, std::chrono::milliseconds(MaxBatchDelay_), [&]() {
+      return static_cast<int>(b->calls.size()) >= MaxBatchSize_ ||
+             runningBatches_ == 0;
+    });
+    if (batch_ == b) {
+      batch_ = nullptr;
+    }
+    runningBatches_++;
+    lock.unlock();
+    runBatch(b);
+    delete b;
+    lock.lock();
+    runningBatches_--;
+    if (batch_ != nullptr) {
+      batch_->ready.notify_one();
+    }
+    lock.unlock();
+  } else {
+    lock.unlock();
+  }
+
+  int ret = result.get();
+  if (ret == BATCHTRYSOLO) {
+    ret = update(fn);
+  }
+  return ret;
+}
+
+void DB::runBatch(struct batch *b) {
+  auto &calls = b->calls;
+  while (!calls.empty()) {
+    int failed = -1;
+    int ret = update([&calls, &failed](TxPtr tx)->int {
+      for (size_t i = 0; i < calls.size(); i++) {
+        if (calls[i].fn(tx) != 0) {
+          failed = i;
+          return -1;
+        }
+      }
+      return 0;
+    });
+    if (failed >= 0) {
+      // 把失败的调用拿出去单独重试，剩下的重新合并
+      std::swap(calls[failed], calls.back());
+      calls.back().result.set_value(BATCHTRYSOLO);
+      calls.pop_back();
+      continue;
+    }
+    for (auto &call : calls) {
+      call.result.set_value(ret);
+    }
+    break;
+  }
+}
+
 void DB::closeTx(TxPtr tx) {
   if (tx == nullptr) {
     return;
   }
+  // 读事务不读rwtx_，下一个写事务可能正在设置它
+  if (tx->readerSlot_ != -1) {
+    removeTx(tx);
+    return;
+  }
   if (rwtx_ && rwtx_ == tx) {
     resetRWTX();
     writerLeave(); // 解锁
@@ -364,17 +1271,36 @@ void DB::resetRWTX() { rwtx_ = nullptr; }
 
 void DB::writerLeave() { rwLock_.unlock(); }
 
-void DB::removeTx(TxPtr tx) {
-  unlockMmapLock();
-  std::lock_guard<std::mutex> guard(metaLock_);
+bool DB::registerReader(Tx *tx) {
+  // 先登记txid再确认它还是最新的。写事务扫描时如果没看到这次登记，
+  // 这里的确认一定能看到它开始时的meta，所以登记的txid不会比写事务以为的最小值小。
+  // init()之后快照的txid只可能比登记的大，多保留一些pending的页
+  auto m = getMeta();
+  if (m == nullptr) {
+    return false;
+  }
+  auto txid = m->txid_;
+  tx->readerSlot_ = readers_.acquire(txid);
+  while ((m = getMeta()) != nullptr && m->txid_ != txid) {
+    txid = m->txid_;
+    readers_.publish(tx->readerSlot_, txid);
+  }
+  if (m == nullptr) {
+    readers_.release(tx->readerSlot_);
+    tx->readerSlot_ = -1;
+    return false;
+  }
+  return true;
+}
 
-  for (auto iter = txs_.begin(); iter != txs_.end(); iter++) {
-    if (*iter == tx) {
-      txs_.erase(iter);
-      return;
-    }
+void DB::removeTx(TxPtr tx) {
+  if (tx->readerSlot_ == -1) {
+    LOG(WARNING) << "tx not found!";
+    return;
   }
-  LOG(WARNING) << "tx not found!";
+  readers_.release(tx->readerSlot_);
+  tx->readerSlot_ = -1;
+  unlockMmapLock();
 }
 
 int DB::view(std::function<int(TxPtr tx)> fn) {
@@ -418,14 +1344,17 @@ TxPtr DB::beginRWTx() {
   }
   rwtx_.reset(new Tx());
   rwtx_->setWriteable(true);
-  rwtx_->init(this);
+  meta *m = nullptr;
+  if (rwtx_->init(this) != 0 || (m = getMeta()) == nullptr) {
+    rwtx_ = nullptr;
+    rwLock_.unlock();
+    return nullptr;
+  }
 
   // Free any pages associated with closed read-only transactions.
-  // 写事务开始时，其他事务肯定已经完成了
-  auto minId = UINT64_MAX;
-  for (auto &it : txs_) {
-    minId = std::min(minId, it->metaData_->txid_);
-  }
+  // 写事务开始时，其他事务肯定已经完成了。
+  // PipelinedCommit时还没落盘的提交释放的页，崩溃后上一个meta还要用，也不能重用
+  auto minId = std::min(readers_.minTxid(), m->txid_ + 1);
 
   //暂存在pending中的page小于最小txid的都释放到free中
   if (minId > 0) {
@@ -435,16 +1364,21 @@ TxPtr DB::beginRWTx() {
 }
 
 TxPtr DB::beginTx() {
-  std::lock_guard<std::mutex> guard(metaLock_);
   getMmapRLock();
   if (!opened_) {
     unlockMmapLock();
     return nullptr;
   }
 
-  txs_.emplace_back(new Tx());
-  auto &tx = txs_.back();
-  tx->init(this);
+  TxPtr tx(new Tx());
+  if (!registerReader(tx.get())) {
+    unlockMmapLock();
+    return nullptr;
+  }
+  if (tx->init(this) != 0) {
+    removeTx(tx);
+    return nullptr;
+  }
   return tx;
 }
 
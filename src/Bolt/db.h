@@ -10,9 +10,11 @@
 #include "util.h"
 #include "tx.h"
 #include "page.h"
+#include "writer.h"
+#include "readerRegistry.h"
 #include <pthread.h>
-#include <obj_pool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -21,13 +23,22 @@
 #include <error.h>
 #include <cassert>
 #include <iostream>
+#include <deque>
 #include <map>
+#include <set>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <future>
 #include <stack>
 #include <vector>
 #include <memory>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <sys/stat.h>
 
 typedef char byte;
@@ -37,10 +48,65 @@ struct Options {
   bool NoGrowSync;
   bool ReadOnly;
   int MmapFlags;
-  uint32_t InitialMMapSize;
+  uint64_t InitialMMapSize;
+  // commit时不写freelist，打开db时遍历所有可达的页重建。小事务少写一次freelist，
+  // 代价是打开变慢，rollback也需要重新遍历
+  bool NoFreelistSync;
+  // 数据页和meta写完之后只fdatasync一次，而不是数据页和meta各一次。meta里记下本次写的页和
+  // 校验和，崩溃后打开db时校验不过就退回到上一个meta
+  bool SingleSyncCommit;
+  // batch()最多合并多少个调用，以及第一个调用最多等多久(ms)，0使用默认值
+  int MaxBatchSize;
+  uint64_t MaxBatchDelay;
+  // 大于0时，打开db时先预留这么大的虚拟地址空间(PROT_NONE, MAP_NORESERVE)，文件变大时
+  // 在预留的空间里原地扩展映射。映射地址不变，扩展时不用等读事务结束，也不用dereference
+  uint64_t MmapReserveSize;
+  // 提交时用io_uring一次提交所有脏页的写和fdatasync，内核不支持时退回pwritev
+  bool IoUring;
+  // 提交时用O_DIRECT写页，不经过page cache，大事务不会把读的热数据挤出去。
+  // 读还是走mmap。文件系统不支持O_DIRECT时退回普通的写
+  bool DirectIO;
+  // 文件每次至少扩展多少字节，0使用默认的16MB
+  uint64_t AllocSize;
+  // 后台线程在提交用到离文件末尾不到AllocSize时提前扩展文件，提交就不用等扩展文件的fsync
+  bool PreGrow;
+  // update()的提交线程只写数据页，fdatasync和写meta交给同步线程，写锁随即放开，下一个写事务
+  // 在这次提交的meta上开始，和落盘重叠。update()等这次提交落盘之后才返回，读事务也只看得到
+  // 已经落盘的meta。同步线程一次fdatasync同时在等的所有提交。落盘失败之后所有的提交都失败，
+  // 需要重新打开db
+  bool PipelinedCommit;
   Options()
       : timeout(0), NoGrowSync(false), ReadOnly(false), MmapFlags(0),
-        InitialMMapSize(0) {}
+        InitialMMapSize(0), NoFreelistSync(false), SingleSyncCommit(false),
+        MaxBatchSize(0),
+        MaxBatchDelay(0), MmapReserveSize(0), IoUring(false),
+        DirectIO(false), AllocSize(0), PreGrow(false), PipelinedCommit(false) {}
+};
+
+// 一组等待合并到同一个写事务里的batch()调用
+struct batch {
+  struct call {
+    std::function<int(TxPtr tx)> fn;
+    std::promise<int> result;
+  };
+  std::vector<call> calls;
+  // 攒够MaxBatchSize_个调用，或者前一个batch提交完时通知第一个调用者
+  std::condition_variable ready;
+};
+
+// 交给同步线程的提交(Options::PipelinedCommit)
+struct pipelinedCommit {
+  txid id;
+  // 按pageAlignment()对齐，DirectIO时也能交给writer_
+  std::unique_ptr<char, void (*)(void *)> metaPage{ nullptr, free };
+  std::promise<int> result;
+};
+
+// 排队等待验证和重放的乐观事务
+struct optimisticCommit {
+  ConflictSet *conflicts;
+  bool done;
+  int result;
 };
 
 class DB {
@@ -61,21 +127,65 @@ public:
     }
     return ret;
   };
+  // Tx::write、Tx::writeMeta和同步线程写meta用它落盘
+  Writer *getWriter() { return writer_.get(); }
+  // 提交时写的页在内存里的对齐，O_DIRECT要求按页对齐
+  size_t pageAlignment() const {
+    return directFile_ != -1 ? pageSize_ : alignof(std::max_align_t);
+  }
   inline bool fileSync() { return fdatasync(file_) == 0; }
   inline freeList *getFreeList() { return freeList_; }
+  // 按bucket并发的写事务同时运行时，访问freelist要持有这个锁
+  std::recursive_mutex &freeListMutex() { return freeListMu_; }
+  // 下一个从文件末尾分配的页号，不小于当前meta的totalPageNumber_
+  pgid getNextPgid();
+  // 普通写事务回滚后freelist重新加载，文件末尾分配的页也一起退回
+  void resetNextPgid();
   uint32_t getPageSize() { return pageSize_; }
-  int initMeta(uint32_t InitialMMapSize);
-  meta *getMeta();
-  int getMmapSize(uint32_t &targetSize);
+  int initMeta(uint64_t InitialMMapSize);
+  meta *getMeta(); // 两个meta都无效时返回nullptr
+  // 读事务的快照：拷贝getMeta()并校验拷贝，拷贝时被同步线程改写了就重新取
+  meta *cloneMeta();
+  int getMmapSize(uint64_t &targetSize);
   bool DbMunmap();
-  bool mmapDbFile(int targetSize);
+  bool mmapDbFile(uint64_t targetSize);
+  // 预留地址空间并把文件映射到开头
+  bool reserveMmap(uint64_t targetSize);
+  // 在预留的地址空间里把映射从datasz_扩展到targetSize，失败返回false
+  bool extendMmap(uint64_t targetSize);
   Page *getPagePtr(pgid pgid);
   Page *allocate(uint32_t numPages,
-                 TxPtr tx); // 分配numPages个连续的页，返回第一个页的指针
+                 Tx *tx); // 分配numPages个连续的页，返回第一个页的指针
+  // 退回tx分配的page，按分配的相反顺序调用时文件末尾的页会让文件不再变大
+  void unallocate(Page *page, Tx *tx);
   int update(std::function<int(TxPtr tx)> fn);
+  // 和update一样，但是多个线程并发的调用会合并成一个写事务提交，只做一次落盘。
+  // 合并的事务中某个fn失败时，整个事务回滚，失败的fn单独用update重试，其余的重新合并提交，
+  // 所以fn可能被调用多次，不能有事务之外的副作用。
+  int batch(std::function<int(TxPtr tx)> fn);
+  // 只写names中的顶层bucket的update。声明的bucket不重叠的事务并发执行fn和spill，
+  // 只有更新根bucket、写freelist和meta以及fdatasync串行，同时在等的事务合并成一次提交。
+  // fn只能访问names中的bucket，不能删除bucket。需要Options::MmapReserveSize，
+  // 没有预留地址空间或者预留的用完时和update一样串行执行，所以fn可能被调用多次。
+  // 提交时还没结束的这类事务分配的页不会记到落盘的freelist里，崩溃后这些页不会再被使用
+  int updateBuckets(const std::vector<std::string> &names,
+                    std::function<int(TxPtr tx)> fn);
+  // 乐观执行的update。fn在读事务的快照上执行，不持有写锁，读过的key范围和写操作都记下来。
+  // 提交时和快照之后提交的事务比较：读过的范围没被改过就把写在最新的版本上重放(rebase)，
+  // 否则放弃，用新的快照重新执行fn，冲突太多次之后退回update。同时在等的事务在一个写事务里
+  // 重放，只落盘一次。普通写事务改了什么不知道，和它们重叠的乐观事务只要读过就要重新执行，
+  // 所以fn可能被调用多次，不能有事务之外的副作用
+  int updateOptimistic(std::function<int(TxPtr tx)> fn);
+  // 写事务提交之后登记它改过的key，writes为nullptr时登记为改了所有key。
+  // 没有乐观事务在执行时只登记还没落盘的提交
+  void recordCommit(txid id, CommittedWrites *writes);
   int view(std::function<int(TxPtr tx)> fn);
   TxPtr beginRWTx(); // 数据库不支持update事务并发
   TxPtr beginTx();
+  // updateBuckets的事务，调用者持有rwLock_的共享锁和names中每个bucket的锁
+  TxPtr beginBucketTx(const std::vector<std::string> &names);
+  // 排队等着和其他updateBuckets的事务一起提交，返回这一组提交的结果
+  int commitGroup(Tx *tx);
   void closeTx(TxPtr tx);
   void removeTx(TxPtr tx);
   bool getMmapRLock(); // 阻塞，没有超时时间
@@ -83,41 +193,131 @@ public:
   bool unlockMmapLock();
   void resetRWTX();
   void writerLeave();
+  void runBatch(struct batch *b);
   bool isNoSync() { return NoSync_; }
+  bool isNoFreelistSync() const { return NoFreelistSync_; }
+  bool isSingleSyncCommit() const { return SingleSyncCommit_; }
+  // SingleSyncCommit写的meta，检查它记录的页都在文件里并且校验和对得上
+  bool verifyMetaPages(meta *m);
+  bool hasSyncedFreelist() {
+    auto m = getMeta();
+    return m != nullptr && m->freeListPageNumber_ != PGIDNOFREELIST;
+  }
+  // 从当前meta的根遍历所有可达的页，返回没被用到的页，有序
+  std::vector<pgid> freePages();
   uint32_t freeListSerialSize() const { return freeList_->size(); }
-  int grow(uint32_t sz);
+  // 保证文件至少有sz字节，提交时调用
+  int grow(uint64_t sz);
+  // 用fallocate把文件扩展到target字节并fsync，调用者持有growFileMu_
+  int growFile(uint64_t target);
+  void preGrowLoop();
   int getFd() const { return file_; }
+  bool isPipelinedCommit() const { return PipelinedCommit_; }
+  // 写事务开始时meta的拷贝。PipelinedCommit时是最后一个交给同步线程的提交的meta
+  meta *cloneWriterMeta();
+  // 数据页已经写完，把meta交给同步线程，结果放进tx->pipelineResult_
+  int queueCommit(Tx *tx);
+  // 等交给同步线程的提交都落盘(或者失败)
+  void drainCommits();
+  // 不经过同步线程的提交落盘之后更新读事务能看到的txid
+  void setDurableTxid(txid id);
+  void syncLoop();
 
 private:
+  // 把tx登记为读者，之后的写事务不会释放它的快照引用的页。取不到有效的meta时返回false
+  bool registerReader(Tx *tx);
+  std::mutex *bucketLock(const std::string &name);
+  // 在一个写事务里提交group中所有事务spill好的bucket
+  int writeGroup(const std::vector<Tx *> &group);
+  // 在当前meta的快照上开始一个乐观事务，读写记到conflicts里
+  TxPtr beginOptimisticTx(ConflictSet *conflicts);
+  void endOptimisticTx(const ConflictSet *conflicts);
+  // 去掉committed_里不晚于snapshot的提交，调用者持有occMu_
+  void pruneCommitted(txid snapshot);
+  // 排队等待验证和重放，冲突时返回TXCONFLICT
+  int commitOptimistic(ConflictSet *conflicts);
+  // 在一个写事务里验证并重放group中的乐观事务，结果记在每个事务的result里
+  void replayOptimistic(const std::vector<optimisticCommit *> &group);
+  int replayWrites(Tx *tx, const ConflictSet &conflicts);
+
   bool StrictMode_;
   bool NoSync_;
   bool NoGrowSync_;
+  bool NoFreelistSync_;
+  bool SingleSyncCommit_;
   int MmapFlags_;
   int MaxBatchSize_;
   uint64_t MaxBatchDelay_; // batch开始前最大是延时
-  int AllocSize_;
+  uint64_t MmapReserveSize_;
+  uint64_t AllocSize_;
   string path_;
   int file_; // db file fd
+  int directFile_; // DirectIO时用O_DIRECT打开的fd，只用来提交时写页
   FlockUtil lock_file_;
+  std::unique_ptr<Writer> writer_;
   void *dataref_; // read only mmap file 利用mmap, 把分页的管理交给了操作系统
   char *data_;
-  int datasz_;
-  uint32_t filesz_;
+  std::atomic<uint64_t> datasz_; // 按bucket并发的写事务分配页时可能原地扩展映射
+  uint64_t reservedsz_; // 预留的地址空间大小，没有预留时为0
+  std::atomic<uint64_t> filesz_; // 提交线程和预扩展线程都会修改
+
   meta *meta0_;
   meta *meta1_;
+  // 只读打开时verifyMetaPages()没通过的meta(txid, checksum)，getMeta()跳过它。
+  // 可写打开时直接把这个meta清零
+  std::pair<txid, uint64_t> rejectedMeta_;
   uint32_t pageSize_;
   bool opened_;
   TxPtr rwtx_;
-  vector<TxPtr> txs_;
+  ReaderRegistry<> readers_; // 读事务的快照txid
   freeList *freeList_;
   // Stats stats_;  // for performance
-  ObjPool<Bucket> bucketPool_; // 线程安全的对象池
-  ObjPool<Cursor> cursorPool_; // 线程安全的对象池
-  ObjPool<Node> nodePool_;     // 线程安全的对象池
   std::mutex batchMu_;
-  batch *batch_;
+  struct batch *batch_; // 正在攒的batch，为空时下一个batch()调用新建一个
+  int runningBatches_;  // 正在执行的batch数，由batchMu_保护
+  // 扩展文件的锁，提交线程和预扩展线程互斥
+  std::mutex growFileMu_;
+  // 保护growTarget_和stopGrow_，只短暂持有，提交通知预扩展线程时不会等它的fsync
+  std::mutex growMu_;
+  std::condition_variable growCond_;
+  uint64_t growTarget_; // 预扩展线程要把文件扩展到的大小
+  bool stopGrow_;
+  std::thread growThread_;
+  bool PipelinedCommit_;
+  // 保护下面同步线程的状态
+  std::mutex syncMu_;
+  std::condition_variable syncCond_;    // 有新的提交或者要停止
+  std::condition_variable durableCond_; // 有提交落盘或者失败了
+  std::deque<pipelinedCommit> syncQueue_;
+  meta *pendingMeta_; // syncQueue_里最后一个提交的meta，队列空时为nullptr
+  bool stopSync_;
+  bool syncFailed_;
+  // 读事务只能看到txid不大于它的meta，没有PipelinedCommit时是UINT64_MAX
+  std::atomic<txid> durableTxid_;
+  std::thread syncThread_;
+  // 保护freeList_和nextPgid_
+  std::recursive_mutex freeListMu_;
+  pgid nextPgid_;
+  std::mutex bucketLocksMu_;
+  std::map<std::string, std::unique_ptr<std::mutex> > bucketLocks_;
+  // updateBuckets的事务排队提交，第一个发现没有人在提交的事务提交整组
+  std::mutex groupMu_;
+  std::condition_variable groupCond_;
+  std::vector<Tx *> groupQueue_;
+  bool groupLeader_;
+  // 保护下面乐观事务的状态。committed_里是最老的乐观事务的快照之后(没有乐观事务时是
+  // 最新的落盘的meta之后)提交的写事务改过的key，occSnapshots_里是执行中的乐观事务的快照，
+  // occActive_比它多的是正在取快照的事务
+  std::mutex occMu_;
+  int occActive_;
+  std::multiset<txid> occSnapshots_;
+  std::deque<CommittedWrites> committed_;
+  std::condition_variable occCond_;
+  std::vector<optimisticCommit *> occQueue_;
+  bool occLeader_;
 
-  std::mutex rwLock_;
+  // 普通写事务持有写锁，updateBuckets的事务持有读锁
+  std::shared_timed_mutex rwLock_;
   std::mutex metaLock_;
   /*
   * 读锁和写锁之前互斥，如果已经有了写锁，下一个写锁必须等所有的锁都unlock之后才能持有写锁
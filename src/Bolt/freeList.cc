@@ -4,19 +4,74 @@
 #include <algorithm>
 #include <iostream>
 
-template <typename T> void print(const T &a) {
-  std::stringstream ss;
-  typename T::const_iterator iter = a.begin();
-  for (; iter != a.end(); iter++) {
-    ss << *iter << ", ";
+freeList::freeList()
+    : forwardMap_(), backwardMap_(), freeMaps_(), freeCount_(0), pending_(),
+      cache_() {}
+
+// varint编码，每个字节低7位存数据，最高位表示后面还有字节
+static const uint32_t MAXVARINTLEN = 10;
+
+static uint32_t varintSize(uint64_t v) {
+  uint32_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
   }
-  LOG(INFO) << ss.str();
+  return n;
 }
 
-freeList::freeList() : ids_(), pending_(), cache_() {}
+static char *putVarint(char *dst, uint64_t v) {
+  auto ptr = reinterpret_cast<uint8_t *>(dst);
+  while (v >= 0x80) {
+    *ptr++ = static_cast<uint8_t>(v | 0x80);
+    v >>= 7;
+  }
+  *ptr++ = static_cast<uint8_t>(v);
+  return reinterpret_cast<char *>(ptr);
+}
 
-// |page haeder|pgid|pgid|...|
+static const char *getVarint(const char *src, uint64_t *v) {
+  auto ptr = reinterpret_cast<const uint8_t *>(src);
+  uint64_t result = 0;
+  for (uint32_t shift = 0; shift < 64; shift += 7) {
+    uint64_t byte = *ptr++;
+    result |= (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  *v = result;
+  return reinterpret_cast<const char *>(ptr);
+}
+
+// 编码格式: |page header|uint64 页数|uint64 区间数|varint gap|varint len|...|
+// 老格式: |page header|pgid|pgid|...|，count为0xffff时第一个pgid是总数
 void freeList::read(Page *page) {
+  if (page->flag & pageFlags::freelistEncodedFlag) {
+    auto header = reinterpret_cast<const uint64_t *>(&page->ptr);
+    uint64_t runs = header[1];
+    auto ptr = reinterpret_cast<const char *>(header + 2);
+    forwardMap_.clear();
+    backwardMap_.clear();
+    freeMaps_.clear();
+    freeCount_ = 0;
+    pgid prevEnd = 0;
+    for (uint64_t i = 0; i < runs; i++) {
+      uint64_t gap, len;
+      ptr = getVarint(ptr, &gap);
+      ptr = getVarint(ptr, &len);
+      addSpan(prevEnd + gap, len);
+      freeCount_ += len;
+      prevEnd += gap + len;
+    }
+    if (freeCount_ != header[0]) {
+      LOG(ERROR) << "freelist page " << page->id << " count mismatch, "
+                 << freeCount_ << " != " << header[0];
+    }
+    reindex();
+    return;
+  }
+
   size_t index = 0;
   size_t count = page->count;
   // If the page.count is at the max uint16 value (64k) then it's considered
@@ -26,153 +81,152 @@ void freeList::read(Page *page) {
     count = *reinterpret_cast<pgid *>(page->ptr);
   }
 
-  if (count == 0) {
-    ids_.clear();
-  } else {
-    ids_.clear();
+  std::vector<pgid> ids;
+  if (count != 0) {
     pgid *ptr = reinterpret_cast<pgid *>(&page->ptr) + index;
-    for (size_t i = 0; i < count; i++) {
-      ids_.push_back(*ptr);
-      ptr++;
-    }
-    std::sort(ids_.begin(), ids_.end());
+    ids.assign(ptr, ptr + count);
+    std::sort(ids.begin(), ids.end());
   }
+  readIds(ids);
   reindex();
 }
 
-// 溢出之后需要重新分配page
-void freeList::write(Page *page) {
-  page->flag |= pageFlags::freelistPageFlag;
-  auto cnt = count();
-  if (cnt == 0) {
-    // 不需要下刷磁盘
-    page->count = 0;
-  } else if (cnt < 0xffff) {
-    page->count = cnt;
-    vector<pgid> dest;
-    // 写mmap，会报错吗？
-    copyall(&dest);
-    // 将所有free/pending都持久化进freeList page
-    // 如果下刷完成之后crash，所有的pending都会转化为free
-    auto ptr = reinterpret_cast<pgid *>(&page->ptr);
-    for (auto &item : dest) {
-      *ptr = item;
-      ptr++;
-    }
-  } else {
-    // 使用额外的页
-    page->count = 0xffff;
-    auto ptr = reinterpret_cast<pgid *>(&page->ptr);
-    *ptr = cnt;
-    ++ptr;
-    std::vector<pgid> dest;
-    copyall(&dest);
-    // TODO(roland):溢出管理
-    for (pgid it : dest) {
-      *ptr = it;
-      ptr++;
+int freeList::write(Page *page, uint32_t pageSize) {
+  page->flag |= pageFlags::freelistPageFlag | pageFlags::freelistEncodedFlag;
+  page->count = 0;
+  std::vector<std::pair<pgid, uint64_t> > runs;
+  spans(&runs);
+
+  uint64_t capacity =
+      static_cast<uint64_t>(page->overflow + 1) * pageSize - PAGEHEADERSIZE;
+  auto header = reinterpret_cast<uint64_t *>(&page->ptr);
+  auto begin = reinterpret_cast<char *>(header + 2);
+  auto end = reinterpret_cast<char *>(&page->ptr) + capacity;
+  auto ptr = begin;
+  uint64_t total = 0;
+  pgid prevEnd = 0;
+  for (auto &run : runs) {
+    uint64_t gap = run.first - prevEnd;
+    if (end - ptr < varintSize(gap) + varintSize(run.second)) {
+      LOG(ERROR) << "freelist does not fit in " << page->overflow + 1
+                 << " pages";
+      return -1;
     }
+    ptr = putVarint(ptr, gap);
+    ptr = putVarint(ptr, run.second);
+    prevEnd = run.first + run.second;
+    total += run.second;
   }
+  header[0] = total;
+  header[1] = runs.size();
+  return 0;
 }
 
 void freeList::reindex() {
   cache_.clear();
-  for (auto &e : ids_) {
-    cache_[e] = true;
-  }
   for (auto &item : pending_) {
     for (auto pgid : item.second) {
-      cache_[pgid] = true;
+      cache_.insert(pgid);
     }
   }
 }
 
-void freeList::copyall(std::vector<pgid> *dest) {
+void freeList::spans(std::vector<std::pair<pgid, uint64_t> > *dest) const {
   vector<pgid> tmp;
   for (auto &it : pending_) {
-    for (auto pg : it.second) {
-      tmp.push_back(pg);
-    }
+    tmp.insert(tmp.end(), it.second.begin(), it.second.end());
   }
   std::sort(tmp.begin(), tmp.end());
-  mergeids_(dest, tmp);
+  // free extents和pending的页不重叠，按起点归并，相邻的拼起来
+  auto push = [dest](pgid start, uint64_t size) {
+    if (!dest->empty() &&
+        dest->back().first + dest->back().second == start) {
+      dest->back().second += size;
+    } else {
+      dest->emplace_back(start, size);
+    }
+  };
+  auto it = forwardMap_.begin();
+  for (size_t i = 0; i < tmp.size();) {
+    size_t j = i + 1;
+    while (j < tmp.size() && tmp[j] == tmp[j - 1] + 1) {
+      j++;
+    }
+    for (; it != forwardMap_.end() && it->first < tmp[i]; ++it) {
+      push(it->first, it->second);
+    }
+    push(tmp[i], j - i);
+    i = j;
+  }
+  for (; it != forwardMap_.end(); ++it) {
+    push(it->first, it->second);
+  }
 }
 
-// merge src and ids_ into dest;
-void freeList::mergeids_(vector<pgid> *dest, const vector<pgid> &src) {
-  auto it1 = src.begin();
-  auto it2 = ids_.begin();
-  while (it1 != src.end() && it2 != ids_.end()) {
-    if (*it1 < *it2) {
-      dest->push_back(*it1++);
-    } else {
-      dest->push_back(*it2++);
+std::vector<pgid> freeList::freePageIds() const {
+  std::vector<pgid> ids;
+  ids.reserve(freeCount_);
+  for (auto &span : forwardMap_) {
+    for (uint64_t i = 0; i < span.second; i++) {
+      ids.push_back(span.first + i);
     }
   }
-  if (it1 != src.end()) {
-    dest->insert(dest->end(), it1, src.end());
+  return ids;
+}
+
+bool freeList::freed(pgid id) const {
+  if (cache_.count(id)) {
+    return true;
   }
-  if (it2 != ids_.end()) {
-    dest->insert(dest->end(), it2, ids_.end());
+  // 找到起点不大于id的最后一个区间
+  auto it = forwardMap_.upper_bound(id);
+  if (it == forwardMap_.begin()) {
+    return false;
   }
-  LOG(INFO) << "pending: ";
-  print(src);
-  LOG(INFO) << "ids_: ";
-  print(ids_);
-  LOG(INFO) << "dest: ";
-  print(*dest);
+  --it;
+  return id < it->first + it->second;
 }
 
+// 按best fit分配：最小的够用区间，同样大小的取页号最小的，剩下的部分放回去
 pgid freeList::allocate(uint32_t numPages) {
-  if (ids_.empty()) {
+  if (numPages == 0) {
     return 0;
   }
-  pgid init = 0;
-  pgid prev = 0;
-
-  for (uint64_t i = 0; i < ids_.size(); i++) {
-    pgid id = ids_[i];
-
-    if (id < 2) {
-      LOG(FATAL) << "Id = " << id;
-      assert(false);
-    }
-
-    if (prev == 0 || id - prev != 1) {
-      // 数组开头或者不连续的话就更新init
-      init = id;
-    }
-
-    if (id - init + 1 == numPages) {
-      LOG(INFO) << "before erase: ";
-      print(ids_);
-      ids_.erase(ids_.begin() + i - numPages + 1, ids_.begin() + i + 1);
-      LOG(INFO) << "after erase: ";
-      print(ids_);
-
-      for (size_t j = 0; j < numPages; j++) {
-        cache_.erase(init + j);
-      }
-      return init;
-    }
-
-    prev = id;
+  auto it = freeMaps_.lower_bound(numPages);
+  if (it == freeMaps_.end()) {
+    return 0;
   }
-  return 0;
+  uint64_t size = it->first;
+  pgid start = *it->second.begin();
+  if (start < 2) {
+    LOG(FATAL) << "Id = " << start;
+    assert(false);
+  }
+  delSpan(start, size);
+  if (size > numPages) {
+    addSpan(start + numPages, size - numPages);
+  }
+  freeCount_ -= numPages;
+  return start;
 }
 
 uint32_t freeList::size() const {
-  auto ret = count();
-  if (ret >= 0xffff) {
-    ret++;
+  std::vector<std::pair<pgid, uint64_t> > runs;
+  spans(&runs);
+  uint64_t ret = PAGEHEADERSIZE + sizeof(uint64_t) * 2;
+  pgid prevEnd = 0;
+  for (auto &run : runs) {
+    ret += varintSize(run.first - prevEnd) + varintSize(run.second);
+    prevEnd = run.first + run.second;
   }
-
-  return PAGEHEADERSIZE + ret * sizeof(pgid);
+  // commit在size()之后才给freelist分配页，会从某个区间的开头切走几页，
+  // 这个区间的gap变大，最多多出一个varint。
+  return ret + MAXVARINTLEN;
 }
 
 uint32_t freeList::count() const { return freeCount() + pendingCount(); }
 
-uint32_t freeList::freeCount() const { return ids_.size(); }
+uint32_t freeList::freeCount() const { return freeCount_; }
 
 uint32_t freeList::pendingCount() const {
   uint32_t result = 0;
@@ -195,10 +249,20 @@ void freeList::release(txid txid) {
       ++it;
     }
   }
-  vector<pgid> tmp1;
   std::sort(tmp.begin(), tmp.end());
-  mergeids_(&tmp1, tmp);
-  ids_ = tmp1;
+  // 连续的页先拼成一个区间再合并，减少索引的更新
+  for (size_t i = 0; i < tmp.size();) {
+    size_t j = i + 1;
+    while (j < tmp.size() && tmp[j] == tmp[j - 1] + 1) {
+      j++;
+    }
+    for (size_t k = i; k < j; k++) {
+      cache_.erase(tmp[k]);
+    }
+    mergeSpan(tmp[i], j - i);
+    freeCount_ += j - i;
+    i = j;
+  }
 }
 
 void freeList::rollback(txid txid) {
@@ -216,41 +280,99 @@ void freeList::free(txid txid, Page *p) {
   auto &ids = pending_[txid];
   for (auto id = p->id; id <= p->id + p->overflow; ++id) {
     // 当前页已经被free了。
-    if (cache_[id]) {
+    if (freed(id)) {
       LOG(INFO) << "ERROR! page " << p->id << " already been freed!";
       assert(false);
     }
     ids.push_back(id);
+    cache_.insert(id);
   }
-  // pending_[txid] = ids;
+}
+
+void freeList::unallocate(pgid start, uint64_t size) {
+  mergeSpan(start, size);
+  freeCount_ += size;
 }
 
 void freeList::reset() {
   pending_.clear();
-  ids_.clear();
   cache_.clear();
+  forwardMap_.clear();
+  backwardMap_.clear();
+  freeMaps_.clear();
+  freeCount_ = 0;
 }
 
 void freeList::reload(Page *pg) {
   read(pg);
 
-  // Build a cache of only pending pages.
-  unordered_map<pgid, bool> curPending;
-  for (auto item : pending_) {
-    for (auto inner : item.second) {
-      curPending[inner] = true;
+  // Check each page in the freelist and build a new available freelist
+  // with any pages not in the pending lists. read() already rebuilt
+  // cache_ from pending_.
+  std::vector<pgid> newIds;
+  for (auto item : freePageIds()) {
+    if (cache_.find(item) == cache_.end()) {
+      newIds.push_back(item);
     }
   }
+  readIds(newIds);
+}
 
-  // Check each page in the freelist and build a new available freelist
-  // with any pages not in the pending lists.
+void freeList::reload(const std::vector<pgid> &ids) {
+  reindex();
   std::vector<pgid> newIds;
-  for (auto item : ids_) {
-    if (curPending.find(item) == curPending.end()) {
+  for (auto item : ids) {
+    if (cache_.find(item) == cache_.end()) {
       newIds.push_back(item);
     }
   }
+  readIds(newIds);
+}
 
-  ids_ = newIds;
-  reindex();
-}
\ No newline at end of file
+void freeList::readIds(const std::vector<pgid> &ids) {
+  forwardMap_.clear();
+  backwardMap_.clear();
+  freeMaps_.clear();
+  freeCount_ = ids.size();
+  for (size_t i = 0; i < ids.size();) {
+    size_t j = i + 1;
+    while (j < ids.size() && ids[j] == ids[j - 1] + 1) {
+      j++;
+    }
+    addSpan(ids[i], j - i);
+    i = j;
+  }
+}
+
+void freeList::addSpan(pgid start, uint64_t size) {
+  forwardMap_[start] = size;
+  backwardMap_[start + size - 1] = size;
+  freeMaps_[size].insert(start);
+}
+
+void freeList::delSpan(pgid start, uint64_t size) {
+  forwardMap_.erase(start);
+  backwardMap_.erase(start + size - 1);
+  auto it = freeMaps_.find(size);
+  it->second.erase(start);
+  if (it->second.empty()) {
+    freeMaps_.erase(it);
+  }
+}
+
+void freeList::mergeSpan(pgid start, uint64_t size) {
+  auto prev = backwardMap_.find(start - 1);
+  if (prev != backwardMap_.end()) {
+    uint64_t prevSize = prev->second;
+    start -= prevSize;
+    delSpan(start, prevSize);
+    size += prevSize;
+  }
+  auto next = forwardMap_.find(start + size);
+  if (next != forwardMap_.end()) {
+    uint64_t nextSize = next->second;
+    delSpan(start + size, nextSize);
+    size += nextSize;
+  }
+  addSpan(start, size);
+}
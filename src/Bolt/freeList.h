@@ -2,53 +2,74 @@
 #define FREE_LIST_H_
 
 #include "type.h"
+#include <map>
+#include <set>
 #include <unordered_map>
+#include <unordered_set>
 using namespace std;
 
 /*
 * pending:正在做某种事务的
-* cache_:目测是update和read都写到内存里，如果回滚直接把页加到ids_里就行了
+* cache_:pending中的页，free的时候用来检查重复释放，rollback直接从里面删掉
 */
 
 // boltdb中使用了MVCC多版本控制，写事务修改的数据都会新分配page存放，以前的page中的数据并不会被删除，而是放入pending中，待事务版本升高，旧数据持有的page便可以释放用来重新进行分配给新的写事务存放数据。
 
 struct Page;
 
-// 读页面内容到内存：对应操作在freelist.read中，页面数据部分保存的是当前闲置页面ID数组，将其读入ids成员中。
-// 写页面内容到磁盘：对应操作在freelist.write中，读取ids数组和pending中的页面id，拼接、排序之后在一起写入磁盘。
+// 读页面内容到内存：对应操作在freelist.read中，页面数据部分保存的是当前闲置页面ID数组，将其按连续区间(extent)建立索引。
+// 写页面内容到磁盘：对应操作在freelist.write中，free extent和pending中的页面id合并成有序的连续区间，
+// 每个区间编码成两个varint(和上一个区间末尾的距离, 长度)写入，可以跨多个连续的页：
+// |page header|uint64 页数|uint64 区间数|varint gap|varint len|...|
 struct freeList {
-  // allocate的时候从ids_取出连续的page
-  vector<pgid> ids_; // all free and available free page ids_.
+  // free的页按连续区间保存，三个索引同步更新：
+  // forwardMap_: start -> size，有序，用于落盘时按页号输出以及查询某页是否free
+  // backwardMap_: end -> size，释放页时O(1)找到紧挨在前面的区间合并
+  // freeMaps_: size -> starts，allocate时lower_bound找到最小的够用区间
+  map<pgid, uint64_t> forwardMap_;
+  unordered_map<pgid, uint64_t> backwardMap_;
+  map<uint64_t, set<pgid> > freeMaps_;
+  uint64_t freeCount_; // 所有free extent的页数之和
 
   // mapping of soon-to-be free page ids_ by tx.
   // 保存事务操作对应的页面ID，键为事务ID，值为页面ID数组。这部分的页面ID，在事务操作完成之后即被释放。
   // free的时候将page放入pending_中
   unordered_map<txid, std::vector<pgid> > pending_;
 
-  // fast lookup of all free and pending_ page ids_.
-  // 标记一个页面ID可用，即这个成员中的所有键都是页面ID，而这些页面ID当前都是闲置可分配使用的。
-  unordered_map<pgid, bool> cache_;
+  // fast lookup of all pending_ page ids_.
+  unordered_set<pgid> cache_;
   freeList();
   void reset();
   void read(Page *page);  // 将freelist中存储的所有页读出
-  void write(Page *page); // 将一个page写进free
-  // list的index，所有free和pending的ids都持久化下来
-  void copyall(std::vector<pgid> *dest);
+  // 将freelist写进page，page有overflow+1个pageSize大小的页，放不下返回-1
+  int write(Page *page, uint32_t pageSize);
+  // 所有free和pending的页合并成的有序区间(start, size)
+  void spans(std::vector<std::pair<pgid, uint64_t> > *dest) const;
   void reindex(); // 重新计算 cache_ index
   uint32_t count() const;
   uint32_t freeCount() const;
   uint32_t pendingCount() const;
-  uint32_t size() const;
-  void mergePageIds(vector<pgid> *dest, const vector<pgid> &src);
+  uint32_t size() const; // write需要的字节数，包括page header
+  std::vector<pgid> freePageIds() const; // 按页号排序展开所有free页
+  bool freed(pgid id) const;             // 页已经free或者在pending中
   pgid allocate(
       uint32_t
           numPages); // 分配连续的numPages个页，如果失败外部的调用方负责mmap额外的页
-  void mergeids_(vector<pgid> *dest, const vector<pgid> &src);
   // 以下事务相关：
   void release(txid txid);
   void rollback(txid txid);
   void reload(Page *pg);
+  // 同上，freelist没有落盘时用遍历出来的free页(有序)重建，去掉pending中的页
+  void reload(const std::vector<pgid> &ids);
+  void readIds(const std::vector<pgid> &ids); // 用有序的free页重建索引
   void free(txid txid, Page *p);
+  // allocate()分配出去但没有提交的页直接放回free，不经过pending
+  void unallocate(pgid start, uint64_t size);
+
+private:
+  void addSpan(pgid start, uint64_t size);
+  void delSpan(pgid start, uint64_t size);
+  void mergeSpan(pgid start, uint64_t size); // 和前后相邻的区间合并后加入
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,5 +1,6 @@
 #include "meta.h"
 #include "page.h"
+#include "util.h"
 #include <cstring>
 
 meta *meta::clone() {
@@ -7,18 +8,25 @@ meta *meta::clone() {
   return ptr;
 }
 
+uint64_t meta::sum64() {
+  auto len = reinterpret_cast<char *>(&checksum_) - reinterpret_cast<char *>(this);
+  return checksum64(this, len);
+}
+
 void meta::write(Page *page) {
   if (root_.root >= totalPageNumber_) {
     assert(false);
   }
-  if (freeListPageNumber_ >= totalPageNumber_) {
+  if (freeListPageNumber_ != PGIDNOFREELIST &&
+      freeListPageNumber_ >= totalPageNumber_) {
     assert(false);
   }
 
   page->id = txid_ % 2; // 两个pageID分开存放
   page->flag |= pageFlags::metaPageFlag;
+  version_ = VERSION;
 
-  checksum_ = 0;
+  checksum_ = sum64();
 
   memmove(page->metaPtr(), this, sizeof(meta));
 }
\ No newline at end of file
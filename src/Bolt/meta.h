@@ -8,7 +8,7 @@ struct meta {
   uint32_t magic_;    // “0xED0CDAED”
   uint32_t version_;  // 程序版本号
   uint32_t pageSize_; // 页面大小，默认4k
-  uint32_t flags_;    // 保留
+  uint32_t flags_;    // METASINGLESYNC
   // meta下面的root存储的是整个数据库的root，数据库中其他的table是整个bucket的子bucket
   bucketHeader root_; // 根bucket
   pgid freeListPageNumber_;
@@ -18,8 +18,31 @@ struct meta {
   meta() {};
   bool validate();
   meta *clone();
-  uint64_t sum64() { return 0; }
+  uint64_t sum64(); // checksum_之前所有字段的校验和
   void write(Page *page);
 } __attribute__((packed));
 
+// 2: leaf/branch页可以去掉key的公共前缀(prefixPageFlag)
+const uint32_t VERSION = 2;
+
+// 单次落盘提交(Options::SingleSyncCommit)写的meta，页里meta后面跟着metaPageRecord
+const uint32_t METASINGLESYNC = 0x01;
+
+struct pageExtent {
+  pgid id;
+  uint32_t count;
+} __attribute__((packed));
+
+// 数据页和meta一起只fdatasync一次，meta可能比数据页先落盘。这里记下这次提交写的所有页，
+// 打开db时重新算校验和，对不上就退回到另一个meta
+struct metaPageRecord {
+  uint64_t checksum; // extents以及其中所有页内容的checksum64
+  uint32_t count;
+  pageExtent extents[0];
+} __attribute__((packed));
+
+// freeListPageNumber_为这个值时freelist没有落盘(Options::NoFreelistSync)，
+// 打开db时遍历B+树重建
+const pgid PGIDNOFREELIST = UINT64_MAX;
+
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "bucket.h"
 #include "page.h"
 #include "tx.h"
+#include "db.h"
 #include <algorithm>
 #include <memory>
 
@@ -48,9 +49,10 @@ uint32_t Node::binarySearch(const InodeList &arr, const Item &key,
   uint32_t mid = (begin + end) / 2;
   while (begin < end) {
     mid = (begin + end) / 2;
-    if (arr[mid].key.data_ > key.data_) {
+    int cmp = arr[mid].key.compare(key);
+    if (cmp > 0) {
       end = mid;
-    } else if (arr[mid].key.data_ == key.data_) {
+    } else if (cmp == 0) {
       found = true;
       return mid;
     } else {
@@ -70,24 +72,31 @@ Node::Node(Bucket *b, NodePtr parentNode)
 // heap memory.
 // This is required when the mmap is reallocated so inodes are not pointing to
 // stale data.
-// 原版实现，如果mmap页变动，需要将所有mmap中的数据拷贝出来
-// 但是目前我的实现由于只要放到内存里就是拷贝（使用string实现）
-// 所以在dereference阶段不需要考虑太多事情
+// Node::read() leaves inodes referencing the page, only inodes touched by put()
+// own their bytes, so this is where the rest of them get copied.
 void Node::dereference() {
-  // clone current node's key
-  //...
-
-  // clone current node's kv pairs
-  // ..
-  // do copy recursively
-  // for (auto &child : children_) {
-  //   child->dereference();
-  // }
+  if (key_.isRef()) {
+    key_ = key_.clone();
+  }
+
+  for (auto &inode : inodeList_) {
+    if (inode.key.isRef()) {
+      inode.key = inode.key.clone();
+    }
+    if (inode.value.isRef()) {
+      inode.value = inode.value.clone();
+    }
+  }
+
+  // Recursively dereference children.
+  for (auto &child : children_) {
+    child->dereference();
+  }
 }
 
 NodePtr Node::root() {
   if (parentNode_ == nullptr) {
-    return shared_from_this();
+    return this;
   }
   return parentNode_->root();
 }
@@ -99,13 +108,47 @@ uint32_t Node::minKeys() {
   return 2;
 }
 
+// a和b的公共前缀长度，最多limit
+static uint32_t commonPrefix(const Item &a, const Item &b, uint32_t limit) {
+  limit = std::min(limit, std::min(a.length_, b.length_));
+  auto pa = a.data();
+  auto pb = b.data();
+  uint32_t i = 0;
+  while (i < limit && pa[i] == pb[i]) {
+    i++;
+  }
+  return i;
+}
+
+uint32_t Node::prefixSize() const {
+  if (inodeList_.empty()) {
+    return 0;
+  }
+  // inode有序，所有key的公共前缀就是第一个和最后一个key的公共前缀
+  auto &first = inodeList_.front().key;
+  return commonPrefix(first, inodeList_.back().key, first.length_);
+}
+
+Item Node::separator(NodePtr left) const {
+  auto &first = inodeList_.front().key;
+  if (left != nullptr && isLeaf_) {
+    // 第一个和左边最后一个key的公共前缀再多一个字节就比左边所有key都大
+    auto &last = left->inodeList_.back().key;
+    auto size = commonPrefix(last, first, last.length_) + 1;
+    return Item(first.data(), std::min(size, first.length_));
+  }
+  if (left == nullptr && !key_.empty() && !(first < key_)) {
+    return key_;
+  }
+  return first;
+}
+
 uint32_t Node::size() const {
-  int size = PAGEHEADERSIZE;
-  for (uint32_t i = 0; i < inodeList_.size(); i++) {
-    auto it = inodeList_[i];
+  uint32_t size = PAGEHEADERSIZE;
+  for (auto &it : inodeList_) {
     size += pageElementSize() + it.key.length_ + it.value.length_;
   }
-  return size;
+  return prefixedSize(size, inodeList_.size(), prefixSize());
 }
 
 uint32_t Node::pageElementSize() const {
@@ -122,7 +165,7 @@ NodePtr Node::childAt(int index) {
   }
   return bucket_->getNode(
       inodeList_[index].pageId,
-      shared_from_this()); // 从当前node所对应的bucket里面获取node。传入child
+      this); // 从当前node所对应的bucket里面获取node。传入child
                            // node所对应的pgid
 }
 
@@ -148,13 +191,22 @@ bool Node::put(const Item &oldKey, const Item &newKey, const Item &value,
   } else {
     target_inode += index;
   }
+  // the node outlives mmap remaps, keep owned copies of what is put into it
   target_inode->flag = flag;
-  target_inode->key = newKey;
-  target_inode->value = value;
+  target_inode->key = newKey.clone();
+  target_inode->value = value.clone();
   target_inode->pageId = pageId;
   return true;
 }
 
+void Node::append(const Item &key, const Item &value) {
+  assert(inodeList_.empty() || inodeList_.back().key < key);
+  inodeList_.emplace_back();
+  auto &inode = inodeList_.back();
+  inode.key = key.clone();
+  inode.value = value.clone();
+}
+
 bool Node::del(const Item &key) {
   bool found = false;
   auto it = binarySearch(inodeList_, key, found);
@@ -169,6 +221,9 @@ bool Node::del(const Item &key) {
   return true;
 }
 
+// inodes keep referencing the page until put() replaces them or the mmap is
+// remapped (see dereference()), so reading a page copies no values. Keys are
+// only copied when the page stores them without their common prefix.
 void Node::read(Page *page) {
   if (!page) {
     LOG(FATAL) << "node read receive nullptr.";
@@ -182,12 +237,12 @@ void Node::read(Page *page) {
     if (this->isLeaf_) {
       auto element = page->getLeafPageElement(i);
       it.flag = element->flag;
-      it.key = element->key();
+      it.key = page->fullKey(element->keyPtr(), element->ksize);
       it.value = element->value();
     } else {
       auto element = page->getBranchPageElement(i);
       it.pageId = element->pageId;
-      it.key = element->key();
+      it.key = page->fullKey(element->keyPtr(), element->ksize);
     }
     // assert(item.key.length_ != 0);
   }
@@ -199,6 +254,19 @@ void Node::read(Page *page) {
   } else {
     key_.reset();
   }
+  // 父节点里指向这个页的可能是截短的分隔key(见separator())，spill和rebalance要用它
+  // 在父节点里找到自己
+  if (parentNode_ != nullptr && !key_.empty()) {
+    bool found = false;
+    auto index = parentNode_->search(key_, found);
+    if (!found && index > 0) {
+      index--;
+    }
+    if (index < parentNode_->inodeList_.size() &&
+        parentNode_->inodeList_[index].pageId == pageId_) {
+      key_ = parentNode_->inodeList_[index].key;
+    }
+  }
 }
 
 // 将node中的元素序列化到page内存中
@@ -224,22 +292,34 @@ void Node::write(Page *page) {
   //|<-page start| &page->ptr               |<-contentPtr  |<-page end
   auto contentPtr = &(reinterpret_cast<char *>(
                          &page->ptr)[inodeList_.size() * pageElementSize()]);
+  // 公共前缀存一次，放在element数组后面，见Page::prefix()
+  uint32_t prefix = prefixSize();
+  if (usePrefix(inodeList_.size(), prefix)) {
+    page->flag |= pageFlags::prefixPageFlag;
+    memcpy(contentPtr, &prefix, sizeof(prefix));
+    contentPtr += sizeof(prefix);
+    memcpy(contentPtr, inodeList_.front().key.data(), prefix);
+    contentPtr += prefix;
+  } else {
+    prefix = 0;
+  }
   for (uint32_t i = 0; i < inodeList_.size(); i++) {
+    auto ksize = inodeList_[i].key.length_ - prefix;
     if (isLeaf_) {
       auto item = page->getLeafPageElement(i);
       item->pos = contentPtr - (char *)item;
       item->flag = inodeList_[i].flag;
-      item->ksize = inodeList_[i].key.length_;
+      item->ksize = ksize;
       item->vsize = inodeList_[i].value.length_;
     } else {
       auto item = page->getBranchPageElement(i);
-      item->pos = contentPtr - (char *)&item;
-      item->ksize = inodeList_[i].key.length_;
+      item->pos = contentPtr - (char *)item;
+      item->ksize = ksize;
       item->pageId = inodeList_[i].pageId;
     }
 
-    memcpy(contentPtr, inodeList_[i].key.c_str(), inodeList_[i].key.length_);
-    contentPtr += inodeList_[i].key.length_;
+    memcpy(contentPtr, inodeList_[i].key.data() + prefix, ksize);
+    contentPtr += ksize;
     memcpy(contentPtr, inodeList_[i].value.c_str(),
            inodeList_[i].value.length_);
     contentPtr += inodeList_[i].value.length_;
@@ -258,15 +338,16 @@ bool Node::spill() {
   for (uint32_t i = 0; i < children_.size(); i++) {
     // spill recursively
     if (children_[i]->spill()) {
-      return false;
+      return true;
     }
   }
 
   children_.clear();
-  auto nodes = split(4096);
-  // auto nodes = split(bucket_->getTx()->db_->getPageSize());
+  auto pageSize = tx->getDB()->getPageSize();
+  auto nodes = split(pageSize);
 
-  for (auto &node : nodes) {
+  for (size_t i = 0; i < nodes.size(); i++) {
+    auto node = nodes[i];
     assert(node);
     if (node->getPageId() > 0) {
       // 当前页之前落盘过，就从相关联的事务中free掉(最终是调用freeList中的free())
@@ -274,11 +355,11 @@ bool Node::spill() {
       tx->free(tx->getTxId(), tx->getPage(node->getPageId()));
     }
 
-    auto page = tx->allocate((size() / 4096) + 1);
-    // auto page = tx->allocate((size() / bucket_->tx_->db_->getPageSize()) +
-    // 1);
+    // 按MAXFILLPERCENT分裂出来的node可能正好是一整页
+    auto page = tx->allocate((node->size() + pageSize - 1) / pageSize);
     if (page == nullptr) {
-      return false;
+      // 返回非0表示失败
+      return true;
     }
 
     if (page->id >= tx->getTotalPageNumber()) {
@@ -293,14 +374,14 @@ bool Node::spill() {
     if (node->parentNode_) {
       auto k = node->key_;
       if (k.length_ == 0) {
-        k = inodeList_.front().key;
+        k = node->inodeList_.front().key;
       }
       Item emptyValue;
+      auto separator = node->separator(i > 0 ? nodes[i - 1] : nullptr);
       // 修改之前存放在parentNode_的本页的key索引
       // 如果有，就修改它，如果没有就插入
-      node->parentNode_->put(k, node->inodeList_.front().key, emptyValue,
-                             node->pageId_, 0);
-      node->key_ = node->inodeList_.front().key;
+      node->parentNode_->put(k, separator, emptyValue, node->pageId_, 0);
+      node->key_ = separator;
       assert(k.length_ > 0);
     }
     // tx->stats_.spillCount++;
@@ -316,35 +397,60 @@ bool Node::spill() {
   return 0;
 }
 
+// split breaks up a node into multiple smaller nodes, if appropriate.
+// This should only be called from the spill() function.
 NodeList Node::split(uint32_t pageSize) {
   NodeList result;
-  auto cur = shared_from_this();
+  result.push_back(this);
+
+  // find every split point first, so each inode is moved once rather than
+  // once for every page in front of it.
+  std::vector<uint32_t> bounds;
+  uint32_t begin = 0;
   while (true) {
-    NodePtr a;
-    NodePtr b;
-    std::tie(a, b) = cur->splitTwo(pageSize);
-    result.push_back(a);
-    if (b == nullptr) {
-      // 当前node一直分裂到无法分裂，保证所有的结果都放到result里面了，再break
+    begin = splitTwo(begin, pageSize);
+    if (begin == 0) {
+      // 剩下的inode放得进一个page，不再分裂
       break;
     }
-    cur = b;
+    bounds.push_back(begin);
+  }
+  if (bounds.empty()) {
+    return result;
   }
+
+  if (parentNode_ == nullptr) {
+    // 如果没有parentNode_，就创建它
+    parentNode_ = bucket_->newNode(nullptr);
+    parentNode_->children_.push_back(this);
+  }
+
+  // 分裂的结果是自己多出来几个平行的节点，挂在parent下。
+  bounds.push_back(inodeList_.size());
+  for (size_t i = 0; i + 1 < bounds.size(); i++) {
+    auto newNode = bucket_->newNode(parentNode_);
+    newNode->isLeaf_ = isLeaf_;
+    parentNode_->children_.push_back(newNode);
+    newNode->inodeList_.assign(
+        std::make_move_iterator(inodeList_.begin() + bounds[i]),
+        std::make_move_iterator(inodeList_.begin() + bounds[i + 1]));
+    result.push_back(newNode);
+  }
+  inodeList_.erase(inodeList_.begin() + bounds.front(), inodeList_.end());
   return result;
 }
 
-std::pair<NodePtr, NodePtr> Node::splitTwo(uint32_t pageSize) {
-  NodePtr a;
-  NodePtr b;
-  if (inodeList_.size() <= MINKEYSPERPAGE * 2 || sizeLessThan(pageSize)) {
+// splitTwo looks at the inodes from |begin| on and returns the index where the
+// next node should start, or 0 if they all fit in a single page.
+uint32_t Node::splitTwo(uint32_t begin, uint32_t pageSize) const {
+  if (inodeList_.size() - begin <= MINKEYSPERPAGE * 2 ||
+      sizeLessThan(begin, pageSize)) {
     // 如果达不到分裂标准，就返回
-    a = shared_from_this();
-    b.reset();
-    return { a, b };
+    return 0;
   }
 
   // calculate threshold
-  double fill = bucket_->getFillPercent();
+  double fill = bucket_->splitFillPercent();
   if (fill < MINFILLPERCENT) {
     fill = MINFILLPERCENT;
   }
@@ -355,36 +461,20 @@ std::pair<NodePtr, NodePtr> Node::splitTwo(uint32_t pageSize) {
   uint32_t threshold = pageSize * fill;
 
   // determinate split position
-  // index must been > 0
-  uint32_t index = splitIndex(threshold);
-
-  if (parentNode_ == nullptr) {
-    // 如果没有parentNode_，就创建它
-    parentNode_ = make_shared<Node>(bucket_, nullptr);
-    parentNode_->children_.push_back(shared_from_this());
-  }
-
-  auto newNode = make_shared<Node>(bucket_, parentNode_);
-  newNode->isLeaf_ = isLeaf_;
-  parentNode_->children_.push_back(newNode);
-
-  for (uint32_t i = index; i < inodeList_.size(); i++) {
-    newNode->inodeList_.push_back(inodeList_[i]);
-  }
-  inodeList_.erase(inodeList_.begin() + index, inodeList_.end());
-
-  // 分裂的结果是自己多出来一个平行的节点，挂在parent下。
-  a = shared_from_this();
-  b = newNode;
-  return { a, b };
+  // index must been > begin
+  return splitIndex(begin, threshold);
 }
 
-bool Node::sizeLessThan(uint32_t s) const {
+// 前缀压缩之后的大小随元素增加不会变小，超过s就可以返回
+bool Node::sizeLessThan(uint32_t begin, uint32_t s) const {
   uint32_t sz = PAGEHEADERSIZE;
-  for (uint32_t i = 0; i < inodeList_.size(); i++) {
+  auto &first = inodeList_[begin].key;
+  uint32_t prefix = first.length_;
+  for (uint32_t i = begin; i < inodeList_.size(); i++) {
     sz += pageElementSize() + inodeList_[i].key.length_ +
           inodeList_[i].value.length_;
-    if (sz >= s) {
+    prefix = commonPrefix(first, inodeList_[i].key, prefix);
+    if (prefixedSize(sz, i - begin + 1, prefix) >= s) {
       return false;
     }
   }
@@ -399,19 +489,25 @@ void Node::free() {
   }
 }
 
-uint32_t Node::splitIndex(uint32_t threshold) {
-  uint32_t index = 0;
+uint32_t Node::splitIndex(uint32_t begin, uint32_t threshold) const {
+  uint32_t index = begin;
   uint32_t sz = PAGEHEADERSIZE;
-  for (uint32_t i = 0; i < inodeList_.size() - MINKEYSPERPAGE; i++) {
+  auto &first = inodeList_[begin].key;
+  uint32_t prefix = first.length_;
+  for (uint32_t i = begin; i < inodeList_.size() - MINKEYSPERPAGE; i++) {
     index = i;
     auto &ref = inodeList_[i];
     auto elementSize = pageElementSize() + ref.key.length_ + ref.value.length_;
+    auto nextPrefix = commonPrefix(first, ref.key, prefix);
     // If we have at least the minimum number of keys and adding another
     // node would put us over the threshold then exit and return.
-    if (i >= MINKEYSPERPAGE && sz + elementSize > threshold) {
+    if (i - begin >= MINKEYSPERPAGE &&
+        prefixedSize(sz + elementSize, i - begin + 1, nextPrefix) >
+            threshold) {
       break;
     }
     sz += elementSize;
+    prefix = nextPrefix;
   }
   return index;
 }
@@ -423,8 +519,7 @@ void Node::rebalance() {
   unbalanced_ = false;
   // bucket_->getTx()->stats_.rebalanceCount++;
 
-  uint32_t threshold = 4096 / 4;
-  // auto threshold = bucket_->tx_->db_->getPageSize() / 4;
+  uint32_t threshold = bucket_->getTx()->getDB()->getPageSize() / 4;
   // Ignore if node is above threshold (25%) and has enough keys.
   if (size() > threshold && inodeList_.size() > minKeys()) {
     return;
@@ -434,7 +529,7 @@ void Node::rebalance() {
     // 如果parentNode_太小了，需要和children合并
     // If root node is a branch and only has one node then collapse it.
     if (!isLeaf_ && inodeList_.size() == 1) {
-      auto child = bucket_->getNode(inodeList_[0].pageId, shared_from_this());
+      auto child = bucket_->getNode(inodeList_[0].pageId, this);
       isLeaf_ = child->isLeaf_;
       inodeList_ = child->inodeList_;
       children_ = child->children_;
@@ -444,7 +539,7 @@ void Node::rebalance() {
         NodePtr n = bucket_->getCachedNode(item.pageId);
 
         if (n) {
-          n->parentNode_ = shared_from_this();
+          n->parentNode_ = this;
         } else {
           assert(false);
         }
@@ -462,7 +557,7 @@ void Node::rebalance() {
   // If node has no keys then just remove it.
   if (numChildren() == 0) {
     parentNode_->del(key_); // 上层node存放当前node的以一个key
-    parentNode_->removeChild(shared_from_this());
+    parentNode_->removeChild(this);
     bucket_->eraseCachedNode(pageId_);
     free();
     parentNode_->rebalance();
@@ -473,7 +568,7 @@ void Node::rebalance() {
 
   // 情况三、本层的两个node合并，选择相邻的两个节点，将右边节点的内容移入左边
   // Destination node is right sibling if idx == 0, otherwise left sibling.
-  if ((parentNode_->childIndex(shared_from_this())) == 0) {
+  if ((parentNode_->childIndex(this)) == 0) {
     // 只有自己是这parentNode下层的第一个节点的时候，才使用右兄弟
     auto target = nextSibling();
     // 将右兄弟的inode移入本node，然后递归调整parentNode
@@ -487,7 +582,7 @@ void Node::rebalance() {
       auto childNode = bucket_->getCachedNode(item.pageId);
       if (childNode) {
         childNode->parentNode_->removeChild(childNode);
-        childNode->parentNode_ = shared_from_this();
+        childNode->parentNode_ = this;
         childNode->parentNode_->children_.push_back(childNode);
       }
     }
@@ -519,7 +614,7 @@ void Node::rebalance() {
     std::copy(inodeList_.begin(), inodeList_.end(),
               std::back_inserter(target->inodeList_));
     parentNode_->del(this->key_);
-    parentNode_->removeChild(shared_from_this());
+    parentNode_->removeChild(this);
     bucket_->eraseCachedNode(this->pageId_);
     this->free();
   }
@@ -554,9 +649,9 @@ NodePtr Node::nextSibling() {
   if (parentNode_ == nullptr) {
     return nullptr; // root node只有一个node
   }
-  auto idx = parentNode_->childIndex(shared_from_this());
-  if (idx == 0) {
-    return nullptr; // TODO(roland):何时会有这种状况？
+  auto idx = parentNode_->childIndex(this);
+  if (idx + 1 >= parentNode_->numChildren()) {
+    return nullptr; // 已经是最右边的node
   }
   return parentNode_->childAt(idx + 1);
 }
@@ -566,7 +661,7 @@ NodePtr Node::prevSibling() {
   if (parentNode_ == nullptr) {
     return nullptr;
   }
-  auto idx = parentNode_->childIndex(shared_from_this());
+  auto idx = parentNode_->childIndex(this);
   if (idx == 0) {
     return nullptr;
   }
@@ -32,7 +32,7 @@ class Page;
 class Bucket;
 // this is a in-memory deserialized page
 // 一个页抽象出来的数据结构
-class Node : public std::enable_shared_from_this<Node> {
+class Node {
   friend class ElementRef;
 
 public:
@@ -51,7 +51,7 @@ public:
    * getter
    */
   pgid getPageId() const { return pageId_; }
-  Inode getInode(size_t idx) { return inodeList_[idx]; }
+  const Inode &getInode(size_t idx) const { return inodeList_[idx]; }
   bool isLeafNode() const { return isLeaf_; }
   std::vector<pgid> branchPageIds();
 
@@ -61,17 +61,21 @@ public:
   //   void do_remove(const Item &key);
   // return size of deserialized Node
   uint32_t size() const;
+  // 所有key的公共前缀长度，写页时按usePrefix()决定是否压缩
+  uint32_t prefixSize() const;
   uint32_t pageElementSize() const;
   NodePtr root();     // 返回最顶层的node
   uint32_t minKeys(); // returns the minimum number of inodes this node
                       // should have.
-  bool sizeLessThan(uint32_t s) const;
+  bool sizeLessThan(uint32_t begin, uint32_t s) const;
   uint32_t childIndex(NodePtr child);
   //   size_t numChildren() const;
   NodePtr nextSibling();
   NodePtr prevSibling();
   bool put(const Item &oldKey, const Item &newKey, const Item &value,
            pgid pageId, uint32_t flag);
+  // key比所有inode都大时直接放到最后，不用二分查找
+  void append(const Item &key, const Item &value);
   bool del(const Item &key);
   void read(Page *page);
   void write(Page *page);
@@ -80,9 +84,13 @@ public:
   void removeChild(NodePtr target);
   void dereference();
   bool spill();
+  // spill时父节点里指向这个node的分隔key。left是同一次分裂出来的左边的node，叶子取第一个key
+  // 比left最后一个key大的最短前缀；没有left时原来的key不比第一个key大就保持不变
+  Item separator(NodePtr left) const;
   NodeList split(uint32_t pageSize);
-  std::pair<NodePtr, NodePtr> splitTwo(uint32_t pageSize);
-  uint32_t splitIndex(uint32_t threshold); // return the size of the first page.
+  uint32_t splitTwo(uint32_t begin, uint32_t pageSize) const;
+  // return the index the next page starts at, counting from begin.
+  uint32_t splitIndex(uint32_t begin, uint32_t threshold) const;
   void rebalance();
   uint32_t numChildren() { return inodeList_.size(); }
   uint32_t binarySearch(const InodeList &target, const Item &key, bool &found);
@@ -97,8 +105,9 @@ private:
   pgid pageId_;
   NodePtr parentNode_;
   NodeList children_; // 新增的子node才会放到children_里，后面去spill
-  InodeList
-  inodeList_; // 数据节点，里面存放的数据是调用方提供的，存放一份数据的拷贝（TODO(roland):免拷优化）
+  // 数据节点。从page读出的inode直接引用page中的数据，put进来的才拷贝一份，
+  // mmap重新映射前由dereference()拷贝
+  InodeList inodeList_;
 };
 
 #endif // NODE_H_
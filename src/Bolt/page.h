@@ -26,8 +26,47 @@ struct Page { // 每个page的头
     auto list = reinterpret_cast<branchPageElement *>(&ptr);
     return static_cast<branchPageElement *>(&list[index]);
   }
+
+  // 带prefixPageFlag的页在element数组后面存一次所有key的公共前缀，element的ksize只是后缀：
+  // |page header|elements|uint32 前缀长度|前缀|kv ...|
+  Item prefix() {
+    if (!(flag & pageFlags::prefixPageFlag)) {
+      return Item();
+    }
+    auto elementSize = (flag & pageFlags::leafPageFlag)
+                           ? sizeof(leafPageElement)
+                           : sizeof(branchPageElement);
+    auto p = ptr + count * elementSize;
+    uint32_t size;
+    memcpy(&size, p, sizeof(size));
+    return Item::ref(p + sizeof(size), size);
+  }
+  // 加上公共前缀的完整key。没有前缀时直接引用页，否则拷贝出来
+  Item fullKey(const char *suffix, uint32_t ksize) {
+    auto p = prefix();
+    if (p.length_ == 0) {
+      return Item::ref(suffix, ksize);
+    }
+    Item key(static_cast<int>(p.length_ + ksize));
+    memcpy(key.c_str(), p.data(), p.length_);
+    memcpy(key.c_str() + p.length_, suffix, ksize);
+    return key;
+  }
 } __attribute__((packed));
 
+// count个key有prefixSize长的公共前缀时，只有存一次前缀比每个key都存省空间才压缩
+inline bool usePrefix(uint32_t count, uint32_t prefixSize) {
+  return prefixSize > 0 && (count - 1) * prefixSize > sizeof(uint32_t);
+}
+// 页上count个元素的大小，rawSize是key都存完整时的大小
+inline uint32_t prefixedSize(uint32_t rawSize, uint32_t count,
+                             uint32_t prefixSize) {
+  if (!usePrefix(count, prefixSize)) {
+    return rawSize;
+  }
+  return rawSize - count * prefixSize + sizeof(uint32_t) + prefixSize;
+}
+
 const uint32_t PAGEHEADERSIZE = offsetof(Page, ptr);
 const uint32_t MINKEYSPERPAGE = 2; // minKeysPerPage
 // const size_t BRANCHPAGEELEMENTSIZE = sizeof(branchPageElement);
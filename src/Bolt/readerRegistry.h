@@ -0,0 +1,140 @@
+#ifndef READER_REGISTRY_H_
+#define READER_REGISTRY_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// 读事务的登记表，代替加锁的txs_。每个读事务占一个槽位，槽位里是它快照的txid，
+// 写事务开始时扫一遍求最小值，决定哪些pending的页可以释放。
+// 登记和注销都只是一次CAS/store，不用全局锁。槽位占满一个cache line，
+// 每个线程优先用上次用过的槽位，线程之间不会抢同一个cache line。没有用过或者被占了时
+// 取最前面的空槽位，用到的槽位集中在前面，求最小值只扫到最后一个在用的槽位。
+// 槽位全满时登记到加锁的overflow_里，下标从SLOTS开始
+template <int SLOTS = 256> class ReaderRegistry {
+public:
+  static constexpr uint64_t EMPTY = UINT64_MAX;
+
+  ReaderRegistry() : highWater_(0), overflowCount_(0) {
+    for (auto &slot : slots_) {
+      slot.txid.store(EMPTY, std::memory_order_relaxed);
+    }
+  }
+  ReaderRegistry(const ReaderRegistry &) = delete;
+  ReaderRegistry &operator=(const ReaderRegistry &) = delete;
+
+  // 占一个空槽位并写入txid，返回槽位下标。槽位全满时登记到overflow_里
+  int acquire(uint64_t txid) {
+    static thread_local int hint = -1;
+    if (hint >= 0 && tryAcquire(hint, txid)) {
+      return hint;
+    }
+    for (int i = 0; i < SLOTS; i++) {
+      if (tryAcquire(i, txid)) {
+        hint = i;
+        return i;
+      }
+    }
+    std::lock_guard<std::mutex> guard(overflowMu_);
+    size_t pos = 0;
+    while (pos < overflow_.size() && overflow_[pos] != EMPTY) {
+      pos++;
+    }
+    if (pos == overflow_.size()) {
+      overflow_.push_back(EMPTY);
+    }
+    overflow_[pos] = txid;
+    overflowCount_.fetch_add(1, std::memory_order_seq_cst);
+    return SLOTS + static_cast<int>(pos);
+  }
+
+  // 更新槽位里的txid。先登记再确认db的txid没变，写事务就不会漏掉这个读事务，见DB::beginTx
+  void publish(int index, uint64_t txid) {
+    if (index >= SLOTS) {
+      std::lock_guard<std::mutex> guard(overflowMu_);
+      overflow_[index - SLOTS] = txid;
+      return;
+    }
+    slots_[index].txid.store(txid, std::memory_order_seq_cst);
+  }
+
+  void release(int index) {
+    if (index >= SLOTS) {
+      std::lock_guard<std::mutex> guard(overflowMu_);
+      overflow_[index - SLOTS] = EMPTY;
+      overflowCount_.fetch_sub(1, std::memory_order_relaxed);
+      return;
+    }
+    slots_[index].txid.store(EMPTY, std::memory_order_release);
+  }
+
+  // 所有登记的读事务中最小的txid，没有读事务时返回EMPTY。
+  // 先把末尾空出来的槽位从highWater_里去掉，只扫到最后一个在用的槽位，
+  // overflow_为空时不加锁。只有写事务调用
+  uint64_t minTxid() {
+    auto end = highWater_.load();
+    while (end > 0 && slots_[end - 1].txid.load() == EMPTY) {
+      // 失败时end是新的highWater_，重新检查
+      if (!highWater_.compare_exchange_strong(end, end - 1)) {
+        continue;
+      }
+      end--;
+      // 降低之前刚被占用的槽位，acquire的raiseHighWater可能已经做完了，由这里加回来
+      if (slots_[end].txid.load() != EMPTY) {
+        raiseHighWater(end + 1);
+        break;
+      }
+    }
+    auto minId = EMPTY;
+    end = highWater_.load();
+    for (int i = 0; i < end; i++) {
+      auto txid = slots_[i].txid.load(std::memory_order_seq_cst);
+      if (txid < minId) {
+        minId = txid;
+      }
+    }
+    if (overflowCount_.load(std::memory_order_seq_cst) != 0) {
+      std::lock_guard<std::mutex> guard(overflowMu_);
+      for (auto txid : overflow_) {
+        if (txid < minId) {
+          minId = txid;
+        }
+      }
+    }
+    return minId;
+  }
+
+private:
+  bool tryAcquire(int index, uint64_t txid) {
+    auto expected = EMPTY;
+    if (slots_[index].txid.load(std::memory_order_relaxed) != EMPTY ||
+        !slots_[index].txid.compare_exchange_strong(expected, txid)) {
+      return false;
+    }
+    raiseHighWater(index + 1);
+    return true;
+  }
+
+  void raiseHighWater(int end) {
+    auto cur = highWater_.load(std::memory_order_relaxed);
+    while (cur < end && !highWater_.compare_exchange_weak(cur, end)) {
+    }
+  }
+
+  // 用填充而不是alignas：C++14下new DB不保证64字节对齐
+  struct Slot {
+    std::atomic<uint64_t> txid;
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+  };
+  Slot slots_[SLOTS];
+  std::atomic<int> highWater_;
+  // 槽位全满时登记的读事务，EMPTY表示空位
+  mutable std::mutex overflowMu_;
+  std::vector<uint64_t> overflow_;
+  std::atomic<int> overflowCount_;
+};
+
+template <int SLOTS> constexpr uint64_t ReaderRegistry<SLOTS>::EMPTY;
+
+#endif // READER_REGISTRY_H_
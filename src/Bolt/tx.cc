@@ -1,29 +1,36 @@
 #include "tx.h"
 #include "db.h"
 
-static int file_data_sync(int fd) {
-  int ret = fdatasync(fd);
-  if (ret != 0) {
-    LOG(INFO) << "fdatasync failed for fd: " << fd;
-  }
-  return ret;
-}
-
 Tx::Tx()
     : writable_(false), managed_(false), db_(nullptr), metaData_(nullptr),
-      rootBucket_() {
-  // rootBucket_.reset(new Bucket(shared_from_this()));
+      rootBucket_(nullptr), readerSlot_(-1), concurrent_(false),
+      needRemap_(false), groupDone_(false), groupResult_(0),
+      conflicts_(nullptr), replayWrites_(nullptr), pipelined_(false),
+      writtenSum_(0), pool_() {}
+
+Tx::~Tx() {
+  close();
+  delete metaData_;
 }
 
-void Tx::init(DB *db) {
-  rootBucket_.reset(new Bucket(shared_from_this()));
+int Tx::init(DB *db) {
+  rootBucket_ = pool_.make<Bucket>(this);
   db_ = db;
   // 创建事务就是把db中的元数据赋值一份到tx中，这些元数据写的过程中会变化，为了保护之前的数据一致性不被破坏，这里需要拷贝一份新数据，事务提交之后使用tx中的数据在把db中数据覆盖一遍。
-  metaData_ = db_->getMeta()->clone(); //对db中的mate做个快照
+  //对db中的mate做个快照，写事务要在还没落盘的提交之上开始
+  metaData_ = writable_ ? db_->cloneWriterMeta() : db_->cloneMeta();
+  if (metaData_ == nullptr) {
+    LOG(ERROR) << "snapshot meta failed!";
+    return -1;
+  }
   rootBucket_->setBucketHeader(metaData_->root_);
   if (writable_) {
     metaData_->txid_ += 1;
+    // 按bucket并发的写事务回滚时放回freelist的页可能在meta的totalPageNumber_之后
+    metaData_->totalPageNumber_ =
+        std::max(metaData_->totalPageNumber_, db_->getNextPgid());
   }
+  return 0;
 }
 
 int Tx::rollback() {
@@ -33,13 +40,41 @@ int Tx::rollback() {
   if (db_ == nullptr) {
     return -1;
   }
-  if (writable_) {
-    db_->getFreeList()->rollback(metaData_->txid_);
-    db_->getFreeList()->reload(db_->getPagePtr(metaData_->freeListPageNumber_));
+  // 乐观事务没有分配和释放过页
+  if (writable_ && conflicts_ == nullptr) {
+    std::lock_guard<std::recursive_mutex> guard(db_->freeListMutex());
+    if (concurrent_) {
+      // 别的写事务还在从freelist分配页，不能重新加载，只撤销这个事务自己的改动
+      if (bucketNames_.empty()) {
+        db_->getFreeList()->rollback(metaData_->txid_);
+      }
+      for (auto &item : dirtyPageTable_) {
+        db_->getFreeList()->unallocate(item.first, item.second->overflow + 1);
+      }
+    } else {
+      // 从落盘的meta重新加载freelist，前面的提交要先落盘
+      db_->drainCommits();
+      db_->getFreeList()->rollback(metaData_->txid_);
+      if (db_->hasSyncedFreelist()) {
+        db_->getFreeList()->reload(
+            db_->getPagePtr(db_->getMeta()->freeListPageNumber_));
+      } else {
+        db_->getFreeList()->reload(db_->freePages());
+      }
+      db_->resetNextPgid();
+    }
   } // 只有写事务需要rollback
+  close();
   return 0;
 }
 
+void Tx::close() {
+  // buckets, cursors, nodes and dirty pages all live in pool_
+  dirtyPageTable_.clear();
+  rootBucket_ = nullptr;
+  pool_.reset();
+}
+
 int Tx::commit() {
   if (managed_) {
     LOG(ERROR) << "transaction not managed!";
@@ -49,6 +84,29 @@ int Tx::commit() {
     LOG(ERROR) << "invalid parameter.";
     return -1;
   }
+  if (conflicts_ != nullptr) {
+    LOG(ERROR) << "optimistic transaction is committed by updateOptimistic.";
+    return -1;
+  }
+
+  if (!bucketNames_.empty()) {
+    // 根bucket、freelist和meta由DB::commitGroup和同时提交的事务一起写
+    if (spillBuckets() != 0) {
+      LOG(ERROR) << "declared bucket spill failed!";
+      rollback();
+      return -1;
+    }
+    if (db_->commitGroup(this) != 0) {
+      LOG(ERROR) << "group commit failed!";
+      rollback();
+      return -1;
+    }
+    close();
+    for (auto &item : commitHandlers_) {
+      item();
+    }
+    return 0;
+  }
 
   // Rebalance nodes which have had deletions.
   rootBucket_->rebalance();
@@ -59,30 +117,38 @@ int Tx::commit() {
   }
 
   metaData_->root_.root = rootBucket_->getRootPage();
-  auto pageId = metaData_->totalPageNumber_;
 
-  free(metaData_->txid_, db_->getPagePtr(metaData_->freeListPageNumber_));
-  auto page = allocate((db_->freeListSerialSize() / 4096) + 1);
-  if (page == nullptr) {
-    LOG(ERROR) << "can not allcate contigious pages durning commit.";
-    rollback();
-    return -1;
+  // 按bucket并发的写事务也在从freelist分配页，算大小、分配和写freelist之间不能被打断
+  std::unique_lock<std::recursive_mutex> freeListLock(db_->freeListMutex());
+  if (metaData_->freeListPageNumber_ != PGIDNOFREELIST) {
+    free(metaData_->txid_, db_->getPagePtr(metaData_->freeListPageNumber_));
   }
-  // if (db_->getFreeList()->write(page)) {
-  //   rollback();
-  //   return -1;
-  // }
-  // 默认write不会出错
-  db_->getFreeList()->write(page);
-
-  metaData_->freeListPageNumber_ = page->id;
-
-  if (metaData_->totalPageNumber_ > pageId) {
-    if (db_->grow((metaData_->totalPageNumber_ + 1) * db_->getPageSize())) {
-      LOG(ERROR) << "grow page failed!";
+  if (db_->isNoFreelistSync()) {
+    // freelist不落盘，下次打开db时遍历重建
+    metaData_->freeListPageNumber_ = PGIDNOFREELIST;
+  } else {
+    auto pageSize = db_->getPageSize();
+    auto page =
+        allocate((db_->freeListSerialSize() + pageSize - 1) / pageSize);
+    if (page == nullptr) {
+      LOG(ERROR) << "can not allcate contigious pages durning commit.";
+      rollback();
+      return -1;
+    }
+    if (db_->getFreeList()->write(page, pageSize)) {
+      LOG(ERROR) << "write freelist failed!";
       rollback();
       return -1;
     }
+    metaData_->freeListPageNumber_ = page->id;
+  }
+  freeListLock.unlock();
+
+  // totalPageNumber_可能在init()里就变大了，grow()在文件够大时什么都不做
+  if (db_->grow((metaData_->totalPageNumber_ + 1) * db_->getPageSize())) {
+    LOG(ERROR) << "grow page failed!";
+    rollback();
+    return -1;
   }
 
   if (write() != 0) {
@@ -91,11 +157,28 @@ int Tx::commit() {
     return -1;
   }
 
+  if (pipelined_) {
+    // fdatasync和meta由同步线程完成，commit handler由DB::update在落盘之后调用
+    if (db_->queueCommit(this) != 0) {
+      rollback();
+      return -1;
+    }
+    db_->recordCommit(metaData_->txid_, replayWrites_);
+    close();
+    return 0;
+  }
+
+  // meta按txid交替写两页，前面的提交落盘之后才能写这次的
+  db_->drainCommits();
   if (writeMeta() != 0) {
     LOG(ERROR) << "write committed meta failed!";
     rollback();
     return -1;
   }
+  db_->setDurableTxid(metaData_->txid_);
+  db_->recordCommit(metaData_->txid_, replayWrites_);
+
+  close();
 
   // for now we don't have any commit handles.
   for (auto &item : commitHandlers_) {
@@ -105,24 +188,82 @@ int Tx::commit() {
   return 0;
 }
 
+bool Tx::isDeclared(const Item &name) const {
+  if (bucketNames_.empty()) {
+    return true;
+  }
+  if (std::find(bucketNames_.begin(), bucketNames_.end(), name) !=
+      bucketNames_.end()) {
+    return true;
+  }
+  LOG(ERROR) << "bucket " << name.toString() << " is not declared!";
+  return false;
+}
+
 Bucket *Tx::getBucket(const Item &name) {
+  if (!isDeclared(name)) {
+    return nullptr;
+  }
   return rootBucket_->getBucketByName(name);
 }
 
 Bucket *Tx::createBucket(const Item &name) {
+  if (!isDeclared(name)) {
+    return nullptr;
+  }
   return rootBucket_->createBucket(name);
 }
 
 Bucket *Tx::createBucketIfNotExists(const Item &name) {
+  if (!isDeclared(name)) {
+    return nullptr;
+  }
   return rootBucket_->createBucketIfNotExists(name);
 }
 
 int Tx::deleteBucket(const Item &name) {
+  if (!bucketNames_.empty()) {
+    // 删除会改动根bucket，只在普通的写事务里做
+    LOG(ERROR) << "can not delete bucket in a bucket transaction!";
+    return -1;
+  }
   rootBucket_->deleteBucket(name);
   return 0;
 }
 
-void Tx::free(txid tid, Page *page) { db_->getFreeList()->free(tid, page); }
+void Tx::free(txid tid, Page *page) {
+  if (conflicts_ != nullptr) {
+    // 重放DeleteBucket的写事务会再释放一次
+    return;
+  }
+  if (!bucketNames_.empty()) {
+    freed_.push_back(page);
+    return;
+  }
+  std::lock_guard<std::recursive_mutex> guard(db_->freeListMutex());
+  db_->getFreeList()->free(tid, page);
+}
+
+int Tx::spillBuckets() {
+  for (auto &name : bucketNames_) {
+    auto child = rootBucket_->getCachedBucket(name);
+    if (child == nullptr) {
+      // fn没有打开过，没有改动
+      continue;
+    }
+    child->rebalance();
+    Item value;
+    if (!rootBucket_->spillChild(child, value)) {
+      return -1;
+    }
+    if (value.empty()) {
+      // 没有改动，也可能是这个事务新建的空bucket，用打开时的value
+      value = child->getValue().clone();
+    }
+    spilledBuckets_.emplace_back(name, value);
+  }
+  return 0;
+}
 
 // page returns a reference to the page with a given id.
 // If page has been written to then a temporary buffered page is returned.
@@ -142,7 +283,7 @@ Page *Tx::getPage(pgid pageId) {
 }
 
 Page *Tx::allocate(uint32_t count) {
-  auto ret = db_->allocate(count, shared_from_this());
+  auto ret = db_->allocate(count, this);
   // free里面连续的页不够
   if (ret == nullptr) {
     return ret;
@@ -155,6 +296,11 @@ Page *Tx::allocate(uint32_t count) {
   return ret;
 }
 
+void Tx::unallocate(Page *page) {
+  dirtyPageTable_.erase(page->id);
+  db_->unallocate(page, this);
+}
+
 void Tx::for_each_page(pgid pageId, int depth,
                        std::function<void(Page *, int)> fn) {
   auto p = getPage(pageId);
@@ -169,64 +315,130 @@ void Tx::for_each_page(pgid pageId, int depth,
 }
 
 int Tx::writeMeta() {
-  std::vector<char> tmp(4096);
-  Page *page = reinterpret_cast<Page *>(tmp.data());
+  auto pageSize = db_->getPageSize();
+  auto buf =
+      static_cast<char *>(pool_.allocate(pageSize, db_->pageAlignment()));
+  memset(buf, 0, pageSize);
+  Page *page = reinterpret_cast<Page *>(buf);
+  if (written_.empty()) {
+    metaData_->flags_ &= ~METASINGLESYNC;
+  } else {
+    metaData_->flags_ |= METASINGLESYNC;
+  }
   metaData_->write(page);
+  if (!written_.empty()) {
+    auto record = reinterpret_cast<metaPageRecord *>(page->metaPtr() + 1);
+    record->checksum = writtenSum_;
+    record->count = written_.size();
+    memcpy(record->extents, written_.data(),
+           written_.size() * sizeof(pageExtent));
+    written_.clear();
+  }
 
-  if (db_->writeAt(tmp.data(), tmp.size(), page->id * 4096) != (int)tmp.size()) {
-    LOG(ERROR) << "writeAt meta failed!";
+  std::vector<WriteRun> runs(1);
+  runs[0].offset = page->id * pageSize;
+  runs[0].length = pageSize;
+  runs[0].iov.push_back(iovec{ buf, pageSize });
+  if (db_->getWriter()->writeRuns(runs, !db_->isNoSync()) != 0) {
+    LOG(ERROR) << "write meta failed!";
     return -1;
   }
+  return 0;
+}
 
-  if (!db_->isNoSync()) {
-    if (file_data_sync(db_->getFd())) {
-      LOG(ERROR) << "meta sync failed!";
-      return -1;
-    }
+bool Tx::recordWritten(const std::vector<Page *> &pages) {
+  auto pageSize = db_->getPageSize();
+  auto capacity = (pageSize - PAGEHEADERSIZE - sizeof(meta) -
+                   sizeof(metaPageRecord)) / sizeof(pageExtent);
+  written_.clear();
+  if (pages.size() > capacity) {
+    // 页太多放不下，这次提交还是先同步数据页
+    return false;
   }
-  return 0;
+  // pages已经按页号排好序
+  for (auto p : pages) {
+    written_.push_back(pageExtent{ p->id, p->overflow + 1 });
+  }
+  // 和DB::verifyMetaPages()的顺序一致：先extents，再依次是每个extent的页
+  writtenSum_ =
+      checksum64(written_.data(), written_.size() * sizeof(pageExtent));
+  for (auto p : pages) {
+    writtenSum_ = checksum64(
+        p, static_cast<size_t>(p->overflow + 1) * pageSize, writtenSum_);
+  }
+  return true;
 }
 
 int Tx::write() {
   std::vector<Page *> pages;
+  // dirtyPageTable_留到close()再清空，按bucket并发的提交失败时要靠它把页放回freelist
   for (auto item : dirtyPageTable_) {
     pages.push_back(item.second);
   }
-  dirtyPageTable_.clear();
-  std::sort(pages.begin(), pages.end());
-
-  for (auto p : pages) {
-    auto length = (p->overflow + 1) * db_->getPageSize();
-    auto offset = p->id * db_->getPageSize();
-    if (db_->writeAt(reinterpret_cast<char *>(p), length, offset) != length) {
-      return -1;
+  // 按文件偏移的顺序写，页号连续的页合并成一次pwritev
+  std::sort(pages.begin(), pages.end(),
+            [](Page *a, Page *b) { return a->id < b->id; });
+
+  auto pageSize = db_->getPageSize();
+  std::vector<WriteRun> runs;
+  for (size_t i = 0; i < pages.size(); i++) {
+    auto p = pages[i];
+    auto size = static_cast<size_t>(p->overflow + 1) * pageSize;
+    if (i == 0 || runs.back().iov.size() >= IOV_MAX ||
+        pages[i - 1]->id + pages[i - 1]->overflow + 1 != p->id) {
+      runs.push_back(WriteRun{ static_cast<off_t>(p->id * pageSize), 0, {} });
     }
+    runs.back().iov.push_back(iovec{ p, size });
+    runs.back().length += size;
   }
+  stats_.writeCount += runs.size();
 
-  if (!db_->isNoSync()) {
-    if (file_data_sync(db_->getFd())) {
-      return -1;
+  // SingleSyncCommit时数据页只在writeMeta里和meta一起落盘
+  // PipelinedCommit时由同步线程落盘
+  bool sync = !db_->isNoSync() && !pipelined_ &&
+              !(db_->isSingleSyncCommit() && recordWritten(pages));
+  return db_->getWriter()->writeRuns(runs, sync);
+}
+
+int DB::grow(uint64_t sz) {
+  if (sz > filesz_) {
+    // 预扩展线程没跟上，在提交里同步扩展
+    std::lock_guard<std::mutex> guard(growFileMu_);
+    if (sz > filesz_) {
+      uint64_t target =
+          datasz_ <= AllocSize_ ? datasz_.load() : sz + AllocSize_;
+      if (growFile(target) != 0) {
+        return -1;
+      }
     }
   }
 
+  if (growThread_.joinable() && sz + AllocSize_ > filesz_) {
+    // 离文件末尾不到一个AllocSize了，让预扩展线程再往后扩展
+    {
+      std::lock_guard<std::mutex> guard(growMu_);
+      growTarget_ = std::max(growTarget_, sz + 2 * AllocSize_);
+    }
+    growCond_.notify_one();
+  }
   return 0;
 }
 
-int DB::grow(uint32_t sz) {
-  if (sz <= filesz_) {
+int DB::growFile(uint64_t target) {
+  if (target <= filesz_) {
     return 0;
   }
-
-  if (datasz_ <= AllocSize_) {
-    sz = datasz_;
-  } else {
-    sz += AllocSize_;
-  }
-
   if (!NoGrowSync_ && !readOnly_) {
-    // increase file's size
-    if (ftruncate(file_, sz)) {
-      return -1;
+    // fallocate预先分配好块，之后在这段区间里写数据时fdatasync不用再更新文件的块映射
+    if (fallocate(file_, 0, filesz_, target - filesz_) != 0) {
+      if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        LOG(ERROR) << "fallocate failed, errno: " << errno;
+        return -1;
+      }
+      // 文件系统不支持fallocate
+      if (ftruncate(file_, target)) {
+        return -1;
+      }
     }
     // make sure that file size is written into metadata
     if (fsync(file_)) {
@@ -234,6 +446,29 @@ int DB::grow(uint32_t sz) {
     }
   }
 
-  filesz_ = sz;
+  filesz_ = target;
   return 0;
+}
+
+void DB::preGrowLoop() {
+  std::unique_lock<std::mutex> lock(growMu_);
+  while (true) {
+    growCond_.wait(lock, [this] { return stopGrow_ || growTarget_ > filesz_; });
+    if (stopGrow_) {
+      return;
+    }
+    auto target = growTarget_;
+    lock.unlock();
+    int ret;
+    {
+      std::lock_guard<std::mutex> guard(growFileMu_);
+      ret = growFile(target);
+    }
+    lock.lock();
+    if (ret != 0) {
+      LOG(ERROR) << "pre-grow file failed!";
+      // 下一次提交会同步扩展
+      growTarget_ = 0;
+    }
+  }
 }
\ No newline at end of file
@@ -4,6 +4,9 @@
 #include "type.h"
 #include "meta.h"
 #include "bucket.h"
+#include "arena.h"
+#include "conflictSet.h"
+#include <future>
 
 struct meta;
 
@@ -31,7 +34,7 @@ struct TxStat {
 class Tx : public std::enable_shared_from_this<Tx> {
 public:
   Tx();
-  ~Tx() {}
+  ~Tx();
   Tx(const Tx &) = delete;
   Tx &operator=(const Tx &) = delete;
   bool isWritable() const { return writable_; }
@@ -39,11 +42,13 @@ public:
   void increaseCurserCount() { stats_.cursorCount++; }
   void increaseNodeCount() { stats_.nodeCount++; }
   Page *allocate(uint32_t count);
+  // 退回这个事务allocate的页，提交时不写，也不进pending
+  void unallocate(Page *page);
   Page *getPage(pgid pageId);
   // 只有写事务在提交事务时，其在事务期间受到操作的数据才需要重新分配新的page来存储
   // 而他们原本所在的page会被pending，在事务完成期间并不会被释放到ids里
   int commit();
-  void init(DB *db);
+  int init(DB *db); // 取不到有效的meta时返回-1
   int rollback();
   Bucket *getBucket(const Item &name);
   Bucket *createBucket(const Item &name);
@@ -51,14 +56,24 @@ public:
   int deleteBucket(const Item &name);
   void free(txid tid, Page *Page);
   txid getTxId() { return metaData_->txid_; }
-  uint32_t getTotalPageNumber() { return metaData_->totalPageNumber_; }
+  pgid getTotalPageNumber() { return metaData_->totalPageNumber_; }
   meta *getMeta() { return metaData_; }
+  DB *getDB() const { return db_; }
+  const TxStat &getStats() const { return stats_; }
   void for_each_page(pgid pageId, int depth, std::function<void(Page *, int)>);
   void addCommitHandle(std::function<void()> fn) {
     commitHandlers_.push_back(fn);
   }
   int writeMeta();
   int write();
+  // SingleSyncCommit时记下write()写的页，放得进meta页就返回true，这次提交只在writeMeta落盘
+  bool recordWritten(const std::vector<Page *> &pages);
+  // DB::updateBuckets的事务提交的第一步：只spill声明的bucket，记下它们在根bucket里的新value
+  int spillBuckets();
+  // 只写声明的bucket的事务只能访问这些bucket
+  bool isDeclared(const Item &name) const;
+  // releases every transaction scoped object, called on commit/rollback
+  void close();
   // int isFreelistCheckOK();
   // bool isBucketsRemainConsistent(Bucket &bucket, std::map<pgid, Page *>
   // &reachable,
@@ -68,11 +83,34 @@ private:
   bool managed_;
   DB *db_;
   meta *metaData_;
-  shared_ptr<Bucket> rootBucket_;                   // meta表中的根bucket
+  Bucket *rootBucket_;                              // meta表中的根bucket
   std::unordered_map<pgid, Page *> dirtyPageTable_; // 只有写事务需要
   std::vector<std::function<void()> > commitHandlers_;
   TxStat stats_;
-  // MemoryPool pool_;
+  int readerSlot_; // 读事务在DB::readers_中的槽位，没有登记时为-1
+  // 和别的写事务同时运行(见DB::updateBuckets)，freelist只能按页撤销，映射只能原地扩展
+  bool concurrent_;
+  bool needRemap_; // 预留的地址空间不够，分配页失败
+  // updateBuckets声明的顶层bucket，为空时是普通的写事务。
+  // 它的txid要到DB::commitGroup里才确定，释放的页先记在freed_里
+  std::vector<Item> bucketNames_;
+  std::vector<Page *> freed_;
+  std::vector<std::pair<Item, Item> > spilledBuckets_; // name, 新的value
+  bool groupDone_; // commitGroup里由提交这一组的线程设置，groupMu_保护
+  int groupResult_;
+  // 乐观写事务(见DB::updateOptimistic)的读写集合，由调用者持有，其他事务为nullptr。
+  // 这种事务在快照上执行，不分配页，也不提交，写在提交时由另一个写事务重放
+  ConflictSet *conflicts_;
+  // 重放乐观事务的写事务提交后登记这些写，为nullptr时登记为改了所有key
+  CommittedWrites *replayWrites_;
+  // DB::update在PipelinedCommit时设置，commit()只写数据页，落盘交给同步线程，
+  // 结果在pipelineResult_里
+  bool pipelined_;
+  std::future<int> pipelineResult_;
+  std::vector<pageExtent> written_; // 见recordWritten，为空时meta不带metaPageRecord
+  uint64_t writtenSum_;
+  // Bucket/Cursor/Node以及dirty page都从这里分配，close()时统一释放
+  Arena pool_;
   friend class DB;
   friend class Bucket;
   friend class Cursor;
@@ -10,6 +10,7 @@
 #include <glog/logging.h>
 #include <cstddef>
 #include <memory>
+#include "string_piece.h"
 
 using namespace std;
 
@@ -18,13 +19,19 @@ struct meta;
 class Tx;
 class Node;
 typedef std::shared_ptr<Tx> TxPtr;
-typedef std::shared_ptr<Node> NodePtr;
+// nodes belong to the write transaction's pool (see Bucket::newNode), so a
+// NodePtr is a plain handle valid until the transaction commits or rolls back.
+typedef Node *NodePtr;
 
 enum pageFlags { //替代 #define
   branchPageFlag = 0x01,
   leafPageFlag = 0x02,
   metaPageFlag = 0x04,
-  freelistPageFlag = 0x10 };
+  freelistPageFlag = 0x10,
+  // freelist页的内容是varint编码的区间，没有这个标记的是老格式的pgid数组
+  freelistEncodedFlag = 0x20,
+  // leaf/branch页里的key去掉了公共前缀，见Page::prefix()
+  prefixPageFlag = 0x40 };
 
 typedef uint64_t pgid;
 typedef uint64_t txid;
@@ -35,57 +42,70 @@ const int bucketLeafFlag = 0x01; // 该leaf中存储的的是其他bucket结构
 // |META_PAGE|META_PAGE|FREELIST_PAGE|DATA_PAGE...|
 
 // string wrapper
-
+// An Item either owns its bytes (data_) or, when built with Item::ref(), is a
+// StringPiece pointing at memory owned by someone else, normally a page in the
+// mmap. Copying an Item keeps its mode. Referencing items handed out by a
+// transaction are only valid for the lifetime of that transaction, clone() them
+// to keep the bytes longer.
 struct Item {
-  Item() : data_(), length_(0) {}
-  // Item(string str) {
-  //   data_ = str;
-  //   length_ = str.size();
-  // }
-  Item(const string &str) {
-    data_ = str;
-    length_ = str.size();
-  }
-  Item(int size) {
-    data_ = std::string(size, '\0');
-    length_ = size;
-  }
-  Item(const Item &item) {
-    this->data_ = item.data_;
-    this->length_ = item.length_;
-  }
-  Item &operator=(const Item &item) {
-    this->data_ = item.data_;
-    this->length_ = item.length_;
-    return *this;
-  }
-  Item(const char *buf, uint32_t len) {
-    data_ = std::string(buf, len);
-    length_ = len;
+  Item() : data_(), ref_(), length_(0) {}
+  Item(const string &str) : data_(str), ref_(), length_(str.size()) {}
+  Item(int size) : data_(size, '\0'), ref_(), length_(size) {}
+  Item(const char *buf, uint32_t len)
+      : data_(buf, len), ref_(), length_(len) {}
+  Item(const Item &item) = default;
+  Item(Item &&item) = default;
+  Item &operator=(const Item &item) = default;
+  Item &operator=(Item &&item) = default;
+
+  // build a non-owning item over |len| bytes at |buf|, no copy is made.
+  static Item ref(const char *buf, uint32_t len) {
+    Item item;
+    item.ref_.set(buf, len);
+    item.length_ = len;
+    return item;
   }
-  char *c_str() { return const_cast<char *>(data_.data()); }
-  bool operator==(const Item &item) { return this->data_ == item.data_; }
-  bool operator!=(const Item &item) { return this->data_ != item.data_; }
-  bool operator<(const Item &item) { return this->data_ < item.data_; }
-  bool operator>(const Item &item) { return this->data_ > item.data_; }
-  bool operator==(const Item &item) const { return this->data_ == item.data_; }
-  bool operator!=(const Item &item) const { return this->data_ != item.data_; }
-  bool operator<(const Item &item) const { return this->data_ < item.data_; }
-  bool operator>(const Item &item) const { return this->data_ > item.data_; }
+  // return an item that owns a copy of the bytes.
+  Item clone() const { return Item(data(), length_); }
+  bool isRef() const { return ref_.data() != nullptr; }
+
+  const char *data() const { return isRef() ? ref_.data() : data_.data(); }
+  char *c_str() { return const_cast<char *>(data()); }
+  StringPiece piece() const { return StringPiece(data(), length_); }
+  std::string toString() const { return isRef() ? ref_.as_string() : data_; }
+  int compare(const Item &item) const { return piece().compare(item.piece()); }
+  bool operator==(const Item &item) const { return piece() == item.piece(); }
+  bool operator!=(const Item &item) const { return piece() != item.piece(); }
+  bool operator<(const Item &item) const { return piece() < item.piece(); }
+  bool operator>(const Item &item) const { return piece() > item.piece(); }
   void reset() {
     data_.clear();
+    ref_.clear();
     length_ = 0;
   }
-  bool empty() { return length_ == 0; }
-  std::string data_;
+  bool empty() const { return length_ == 0; }
+  std::string data_; // owned bytes, unused by referencing items
+  StringPiece ref_;  // referenced bytes, null for owning items
   uint32_t length_ = 0;
 };
 
+// compares |len| bytes at |ptr| with |item| the same way Item does, without
+// building a temporary Item. returns <0, 0 or >0.
+inline int compareKey(const char *ptr, uint32_t len, const Item &item) {
+  return StringPiece(ptr, len).compare(item.piece());
+}
+
 namespace std {
 template <> struct hash<Item> {
+  // FNV-1a over the bytes, so owning and referencing items hash alike
   std::size_t operator()(Item const &item) const noexcept {
-    return std::hash<string> {}
-    (item.data_);
+    std::size_t h = 14695981039346656037ULL;
+    auto ptr = item.data();
+    for (uint32_t i = 0; i < item.length_; i++) {
+      h ^= static_cast<unsigned char>(ptr[i]);
+      h *= 1099511628211ULL;
+    }
+    return h;
   }
 };
 }
@@ -95,14 +115,17 @@ struct leafPageElement {
   uint32_t pos = 0;
   uint32_t ksize = 0;
   uint32_t vsize = 0;
+  // key and value reference the page, see Item::ref()
   Item read(uint32_t p, uint32_t s) const {
     const auto *ptr = reinterpret_cast<const char *>(this);
-    //    return std::string(&ptr[p], &ptr[p + s]);
-    return { &ptr[p], s };
+    return Item::ref(&ptr[p], s);
   }
   Item key() const {
     return read(pos, ksize);
   } // 从当前位置算偏移，得到key和value值
+  const char *keyPtr() const {
+    return &reinterpret_cast<const char *>(this)[pos];
+  }
   Item value() const { return read(pos + ksize, vsize); }
   char *valuePtr() { return &(reinterpret_cast<char *>(this))[pos + ksize]; }
 } __attribute__((packed));
@@ -114,12 +137,11 @@ struct branchPageElement {
 
   Item key() const {
     auto ptr = reinterpret_cast<const char *>(this);
-    return { &ptr[pos], ksize };
+    return Item::ref(&ptr[pos], ksize);
+  }
+  const char *keyPtr() const {
+    return &reinterpret_cast<const char *>(this)[pos];
   }
 } __attribute__((packed));
 
-struct batch {
-  DB *db;
-};
-
 #endif // TYPE_H_
\ No newline at end of file
@@ -5,10 +5,29 @@
 #include <glog/logging.h>
 #include <iostream>
 #include <unistd.h>
+#include <string.h>
 #include <string>
 
 using namespace std;
 
+// 64位校验和，每次处理8个字节。seed传入上一段的结果可以把多段数据串起来算
+inline uint64_t checksum64(const void *data, size_t len, uint64_t seed = 0) {
+  const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+  auto ptr = static_cast<const unsigned char *>(data);
+  uint64_t h = seed ^ (len * prime);
+  for (; len >= 8; len -= 8, ptr += 8) {
+    uint64_t word;
+    memcpy(&word, ptr, sizeof(word));
+    h = (h ^ word) * prime;
+    h ^= h >> 32;
+  }
+  for (; len > 0; len--, ptr++) {
+    h = (h ^ *ptr) * prime;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
 class FlockUtil {
 public:
   explicit FlockUtil(const std::string lock_file) : lock_file_(lock_file) {}
@@ -0,0 +1,209 @@
+#include "writer.h"
+#include "util.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+int SyncWriter::writeRuns(const std::vector<WriteRun> &runs, bool sync) {
+  for (auto &run : runs) {
+    auto ret = ::pwritev(fd_, run.iov.data(), run.iov.size(), run.offset);
+    if (ret != static_cast<ssize_t>(run.length)) {
+      LOG(ERROR) << "pwritev failed! ret: " << ret;
+      return -1;
+    }
+  }
+  if (sync && fdatasync(fd_)) {
+    LOG(ERROR) << "fdatasync failed!";
+    return -1;
+  }
+  return 0;
+}
+
+std::unique_ptr<UringWriter> UringWriter::create(int fd, unsigned entries) {
+  std::unique_ptr<UringWriter> writer(new UringWriter(fd));
+  if (writer->setup(entries) != 0) {
+    return nullptr;
+  }
+  return writer;
+}
+
+UringWriter::~UringWriter() {
+  if (sqes_) {
+    ::munmap(sqes_, sqesSize_);
+  }
+  if (cqRing_) {
+    ::munmap(cqRing_, cqRingSize_);
+  }
+  if (sqRing_) {
+    ::munmap(sqRing_, sqRingSize_);
+  }
+  if (ringFd_ >= 0) {
+    ::close(ringFd_);
+  }
+}
+
+int UringWriter::setup(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringFd_ = ::syscall(__NR_io_uring_setup, entries, &params);
+  if (ringFd_ < 0) {
+    LOG(WARNING) << "io_uring_setup failed, errno: " << errno;
+    return -1;
+  }
+  // sq, cq和sqe数组分开映射，老内核没有IORING_FEAT_SINGLE_MMAP也能用
+  sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  auto map = [this](size_t size, off_t offset)->void * {
+    auto ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd_, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+  };
+  sqRing_ = map(sqRingSize_, IORING_OFF_SQ_RING);
+  cqRing_ = map(cqRingSize_, IORING_OFF_CQ_RING);
+  sqes_ = static_cast<struct io_uring_sqe *>(map(sqesSize_, IORING_OFF_SQES));
+  if (!sqRing_ || !cqRing_ || !sqes_) {
+    LOG(WARNING) << "mmap io_uring failed!";
+    return -1;
+  }
+  auto sq = static_cast<char *>(sqRing_);
+  sqHead_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sqMask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  sqEntries_ = params.sq_entries;
+  auto cq = static_cast<char *>(cqRing_);
+  cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cqMask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  return 0;
+}
+
+struct io_uring_sqe *UringWriter::getSqe() {
+  auto head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+  auto tail = *sqTail_ + pending_;
+  if (tail - head >= sqEntries_) {
+    return nullptr;
+  }
+  auto index = tail & *sqMask_;
+  sqArray_[index] = index;
+  pending_++;
+  auto sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int UringWriter::submitAndWait(unsigned count, std::vector<int64_t> &results) {
+  __atomic_store_n(sqTail_, *sqTail_ + pending_, __ATOMIC_RELEASE);
+  auto toSubmit = pending_;
+  pending_ = 0;
+  results.assign(count, 0);
+  unsigned completed = 0;
+  while (completed < count) {
+    auto ret = ::syscall(__NR_io_uring_enter, ringFd_, toSubmit,
+                         count - completed, IORING_ENTER_GETEVENTS, nullptr,
+                         0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(ERROR) << "io_uring_enter failed, errno: " << errno;
+      return -1;
+    }
+    toSubmit -= std::min<unsigned>(toSubmit, ret);
+    auto head = *cqHead_;
+    auto tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      auto &cqe = cqes_[head & *cqMask_];
+      if (cqe.user_data < count) {
+        results[cqe.user_data] = cqe.res;
+      }
+      completed++;
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+int UringWriter::writeRuns(const std::vector<WriteRun> &runs, bool sync) {
+  std::lock_guard<std::mutex> guard(mu_);
+  std::vector<int64_t> results;
+  bool synced = !sync;
+  bool shortWrite = false;
+  size_t next = 0;
+  // sq放不下时分几批提交，fdatasync跟在最后一批后面
+  while (next < runs.size() || !synced) {
+    auto first = next;
+    unsigned count = 0;
+    while (next < runs.size()) {
+      auto sqe = getSqe();
+      if (!sqe) {
+        break;
+      }
+      auto &run = runs[next];
+      sqe->opcode = IORING_OP_WRITEV;
+      sqe->fd = fd_;
+      sqe->off = run.offset;
+      sqe->addr = reinterpret_cast<uint64_t>(run.iov.data());
+      sqe->len = run.iov.size();
+      sqe->user_data = count++;
+      next++;
+    }
+    unsigned syncIndex = count;
+    if (next == runs.size() && !synced) {
+      auto sqe = getSqe();
+      if (sqe) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd_;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        // 等前面的写都完成了再开始
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->user_data = count++;
+        synced = true;
+      }
+    }
+    if (submitAndWait(count, results) != 0) {
+      return -1;
+    }
+    for (auto i = first; i < next; i++) {
+      auto &run = runs[i];
+      auto ret = results[i - first];
+      if (ret < 0) {
+        LOG(ERROR) << "io_uring writev failed, errno: " << -ret;
+        return -1;
+      }
+      if (static_cast<size_t>(ret) < run.length) {
+        // 短写很少见，整个run同步重写一遍
+        shortWrite = true;
+        if (rewriteRun(run) != 0) {
+          return -1;
+        }
+      }
+    }
+    if (syncIndex < count && results[syncIndex] < 0) {
+      LOG(ERROR) << "io_uring fdatasync failed, errno: " << -results[syncIndex];
+      return -1;
+    }
+  }
+  // 重写的run可能在fdatasync之后才写完
+  if (sync && shortWrite && fdatasync(fd_)) {
+    LOG(ERROR) << "fdatasync failed!";
+    return -1;
+  }
+  return 0;
+}
+
+int UringWriter::rewriteRun(const WriteRun &run) {
+  ssize_t ret;
+  do {
+    ret = ::pwritev(fd_, run.iov.data(), run.iov.size(), run.offset);
+  } while (ret == -1 && errno == EINTR);
+  if (ret != static_cast<ssize_t>(run.length)) {
+    LOG(ERROR) << "pwritev failed! ret: " << ret;
+    return -1;
+  }
+  return 0;
+}
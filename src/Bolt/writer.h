@@ -0,0 +1,80 @@
+#ifndef WRITER_H_
+#define WRITER_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// 一段连续的文件区间，由若干块内存依次拼起来
+struct WriteRun {
+  off_t offset;
+  size_t length;
+  std::vector<struct iovec> iov;
+};
+
+// Tx::write和Tx::writeMeta落盘用的接口。
+// writeRuns把所有区间写完，sync为true时再做一次fdatasync，成功返回0
+class Writer {
+public:
+  virtual ~Writer() {}
+  virtual int writeRuns(const std::vector<WriteRun> &runs, bool sync) = 0;
+};
+
+// 默认实现，每个区间一次pwritev，最后fdatasync
+class SyncWriter : public Writer {
+public:
+  explicit SyncWriter(int fd) : fd_(fd) {}
+  int writeRuns(const std::vector<WriteRun> &runs, bool sync) override;
+
+private:
+  int fd_;
+};
+
+// io_uring实现，所有区间的写和后面的fdatasync一起提交，一次io_uring_enter等它们全部完成。
+// fdatasync带IOSQE_IO_DRAIN，在前面的写都完成之后才开始。
+// 不依赖liburing，直接用系统调用。ring只有一个，PipelinedCommit时同步线程写meta和
+// 下一个写事务写数据页可能同时调用writeRuns，用mu_串行
+class UringWriter : public Writer {
+public:
+  ~UringWriter();
+  // 内核不支持或者被禁用时返回nullptr
+  static std::unique_ptr<UringWriter> create(int fd, unsigned entries = 256);
+  int writeRuns(const std::vector<WriteRun> &runs, bool sync) override;
+
+private:
+  explicit UringWriter(int fd) : fd_(fd) {}
+  int setup(unsigned entries);
+  // 取一个空的sqe，sq满了返回nullptr
+  struct io_uring_sqe *getSqe();
+  // 提交所有sqe并等待count个完成，结果按user_data存入results
+  int submitAndWait(unsigned count, std::vector<int64_t> &results);
+  // 短写之后用pwritev同步重写整个run。O_DIRECT要求偏移和长度都对齐，
+  // 只补剩下的部分会EINVAL，run本身是按页对齐的
+  int rewriteRun(const WriteRun &run);
+
+  int fd_;
+  std::mutex mu_;
+  int ringFd_ = -1;
+  void *sqRing_ = nullptr;
+  void *cqRing_ = nullptr;
+  struct io_uring_sqe *sqes_ = nullptr;
+  size_t sqRingSize_ = 0;
+  size_t cqRingSize_ = 0;
+  size_t sqesSize_ = 0;
+  // 指向共享的ring里的字段
+  unsigned *sqHead_ = nullptr;
+  unsigned *sqTail_ = nullptr;
+  unsigned *sqMask_ = nullptr;
+  unsigned *sqArray_ = nullptr;
+  unsigned sqEntries_ = 0;
+  unsigned *cqHead_ = nullptr;
+  unsigned *cqTail_ = nullptr;
+  unsigned *cqMask_ = nullptr;
+  struct io_uring_cqe *cqes_ = nullptr;
+  unsigned pending_ = 0; // 已经放进sq还没提交的sqe数
+};
+
+#endif // WRITER_H_
@@ -1,11 +1,16 @@
 #include <util.h>
 #include <thread>
+#include <atomic>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <iostream>
 #include <sys/time.h>
 #include <stdlib.h> /* srand, rand */
+#include <random>
+#include <cmath>
 #include "db.h"
+#include "freeList.h"
+#include "page.h"
 #include "testBase.h"
 
 static std::string bucketname = "roland_test";
@@ -166,7 +171,7 @@ void test_8byte_query_transaction(std::shared_ptr<DB> db) {
     auto ret = b->get(str);
 
     if (ret.empty()) {
-      LOG(ERROR) << "query failed!" << str.data_;
+      LOG(ERROR) << "query failed!" << str.toString();
       return -1;
     }
     return 0;
@@ -193,6 +198,1114 @@ void test_8byte_query_transaction(std::shared_ptr<DB> db) {
                                                     intervals;
 }
 
+// point lookups on random 8-byte keys inside a single read transaction, so
+// the numbers reflect the cursor search path rather than transaction setup.
+void test_8byte_random_lookup(std::shared_ptr<DB> db) {
+  auto func = [](TxPtr tx)->int {
+    uint64_t intervals = 0, begin, end;
+    auto b = tx->getBucket(bucketname);
+    std::vector<Item> keys;
+    for (uint64_t i = 0; i < max_recursion; ++i) {
+      std::ostringstream ss;
+      ss << std::setw(8) << std::setfill('0') << (rand() % max_recursion);
+      keys.emplace_back(ss.str());
+    }
+
+    begin = usec_now();
+    for (auto &key : keys) {
+      if (b->get(key).empty()) {
+        LOG(ERROR) << "lookup failed!" << key.toString();
+        return -1;
+      }
+    }
+    end = usec_now();
+    intervals = end - begin;
+
+    LOG(WARNING) << "finishing test_8byte_random_lookup with " << max_recursion
+                 << " recursion, time used(usec): " << intervals;
+    LOG(WARNING) << "lookup per second: " << max_recursion * 1000000 /
+                                                 intervals;
+    return 0;
+  };
+  int ret = db->view(func);
+  if (ret != 0) {
+    LOG(ERROR) << "test_8byte_random_lookup failed!";
+  }
+}
+
+// one transaction per small put into an already populated bucket. every
+// commit has to materialize the leaf it touches, so this tracks the cost of
+// turning a page into a node as well as the commit itself.
+void test_small_value_commit(std::shared_ptr<DB> db) {
+  uint64_t intervals = 0, putIntervals = 0, begin, end;
+
+  auto func = [&putIntervals](const Item & key, TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    auto putBegin = usec_now();
+    int ret = b->put(key, Item(string("v")));
+    putIntervals += usec_now() - putBegin;
+    if (ret != 0) {
+      LOG(ERROR) << "insertion failed!";
+      return -1;
+    }
+    return 0;
+  };
+
+  for (uint64_t i = 0; i < max_recursion; ++i) {
+    std::ostringstream ss;
+    ss << std::setw(8) << std::setfill('0') << (rand() % max_recursion);
+    Item str = Item(ss.str());
+    auto func_1 = std::bind(func, str, std::placeholders::_1);
+    begin = usec_now();
+
+    int ret = db->update(func_1);
+    if (ret != 0) {
+      LOG(ERROR) << "test_small_value_commit failed!";
+    }
+    end = usec_now();
+    intervals += end - begin;
+  }
+  LOG(WARNING) << "finishing test_small_value_commit with " << max_recursion
+               << " recursion, time used(usec): " << intervals
+               << ", in put(usec): " << putIntervals;
+  LOG(WARNING) << "transaction per second: " << max_recursion * 1000000 /
+                                                    intervals;
+}
+
+// 碎片化的freelist上反复allocate/free/release，不经过DB
+void test_freelist_fragmentation() {
+  freeList f;
+  // 每隔一段留一个洞，free的区间长度1~3，共max_recursion个区间
+  std::vector<pgid> ids;
+  pgid id = 2;
+  for (uint64_t i = 0; i < max_recursion; ++i) {
+    uint64_t len = rand() % 3 + 1;
+    for (uint64_t j = 0; j < len; ++j) {
+      ids.push_back(id++);
+    }
+    id++;
+  }
+  txid tx = 1;
+  for (auto pg : ids) {
+    Page p{ .id = pg, .flag = 0, .count = 0, .overflow = 0 };
+    f.free(tx, &p);
+  }
+  f.release(tx++);
+
+  uint64_t intervals = 0, begin, end, misses = 0;
+  for (uint64_t i = 0; i < max_recursion; ++i) {
+    uint32_t n = rand() % 4 + 1;
+    begin = usec_now();
+    pgid pg = f.allocate(n);
+    if (pg != 0) {
+      Page p{ .id = pg, .flag = 0, .count = 0, .overflow = n - 1 };
+      f.free(tx, &p);
+    } else {
+      misses++;
+    }
+    f.release(tx++);
+    end = usec_now();
+    intervals += end - begin;
+  }
+  LOG(WARNING) << "finishing test_freelist_fragmentation with "
+               << max_recursion << " recursion, free pages: " << ids.size()
+               << ", misses: " << misses << ", time used(usec): " << intervals;
+  LOG(WARNING) << "allocate/release per second: "
+               << max_recursion * 1000000 / (intervals + 1);
+}
+
+// 多个线程并发地每个事务写一条记录，比较update和batch(合并提交)的TPS
+void test_concurrent_transaction(std::shared_ptr<DB> db, bool useBatch,
+                                 int threads) {
+  uint64_t begin, end;
+  std::atomic<uint64_t> failed(0);
+  std::vector<std::thread> workers;
+  begin = usec_now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([db, useBatch, threads, t, &failed]() {
+      for (uint64_t i = t; i < max_recursion; i += threads) {
+        std::ostringstream ss;
+        ss << std::setw(8) << std::setfill('0') << (rand() % max_recursion);
+        Item str = Item(ss.str());
+        auto func = [str](TxPtr tx)->int {
+          return tx->getBucket(bucketname)->put(str, str);
+        };
+        int ret = useBatch ? db->batch(func) : db->update(func);
+        if (ret != 0) {
+          failed++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  end = usec_now();
+  if (failed != 0) {
+    LOG(ERROR) << "test_concurrent_transaction failed: " << failed;
+  }
+  LOG(WARNING) << "finishing test_concurrent_transaction("
+               << (useBatch ? "batch" : "update") << ", " << threads
+               << " threads) with " << max_recursion
+               << " recursion, time used(usec): " << end - begin;
+  LOG(WARNING) << "transaction per second: " << max_recursion * 1000000 /
+                                                    (end - begin);
+}
+
+// 每个事务按zipf分布(参数theta，0是均匀分布，越大越集中在少数热点key上)选一个计数器加一，
+// 比较持有写锁的update和乐观执行的updateOptimistic的TPS
+void test_optimistic_contention(bool optimistic, double theta, int threads) {
+  const int keys = 10000;
+  Options options;
+  options.MmapReserveSize = 1ULL << 30;
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(options) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([keys](TxPtr tx)->int {
+    auto b = tx->createBucket(bucketname);
+    if (b == nullptr) {
+      return -1;
+    }
+    for (int i = 0; i < keys; ++i) {
+      b->put(Item(std::to_string(i)), Item(std::to_string(0)));
+    }
+    return 0;
+  });
+  std::vector<double> weights(keys);
+  for (int i = 0; i < keys; ++i) {
+    weights[i] = 1.0 / std::pow(i + 1, theta);
+  }
+  std::atomic<uint64_t> failed(0), calls(0);
+  std::vector<std::thread> workers;
+  uint64_t begin = usec_now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      std::mt19937 gen(t);
+      std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+      for (uint64_t i = t; i < max_recursion; i += threads) {
+        Item key(std::to_string(zipf(gen)));
+        std::function<int(TxPtr)> func = [&key, &calls](TxPtr tx)->int {
+          calls++;
+          auto b = tx->getBucket(bucketname);
+          auto value = std::stoull(b->get(key).toString());
+          return b->put(key, Item(std::to_string(value + 1)));
+        };
+        int ret = optimistic ? db.updateOptimistic(func) : db.update(func);
+        if (ret != 0) {
+          failed++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  uint64_t end = usec_now();
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  if (failed != 0) {
+    LOG(ERROR) << "test_optimistic_contention failed: " << failed;
+  }
+  LOG(WARNING) << "finishing test_optimistic_contention("
+               << (optimistic ? "updateOptimistic" : "update")
+               << ", theta=" << theta << ", " << threads << " threads) with "
+               << max_recursion << " recursion, time used(usec): "
+               << end - begin << ", fn calls: " << calls;
+  LOG(WARNING) << "transaction per second: "
+               << max_recursion * 1000000 / (end - begin + 1);
+}
+
+// 每个线程写自己的顶层bucket(多租户)，比较update和updateBuckets的TPS
+void test_tenant_buckets(bool useBuckets, int threads) {
+  Options options;
+  options.MmapReserveSize = 1ULL << 30;
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(options) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([threads](TxPtr tx)->int {
+    for (int t = 0; t < threads; ++t) {
+      if (tx->createBucket(Item("tenant" + std::to_string(t))) == nullptr) {
+        return -1;
+      }
+    }
+    return 0;
+  });
+  std::atomic<uint64_t> failed(0);
+  std::vector<std::thread> workers;
+  uint64_t begin = usec_now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&db, &failed, useBuckets, threads, t]() {
+      std::string tenant = "tenant" + std::to_string(t);
+      std::vector<std::string> names{ tenant };
+      for (uint64_t i = t; i < max_recursion; i += threads) {
+        std::ostringstream ss;
+        ss << std::setw(8) << std::setfill('0') << (rand() % max_recursion);
+        Item str = Item(ss.str());
+        std::function<int(TxPtr)> func = [&tenant, str](TxPtr tx)->int {
+          return tx->getBucket(Item(tenant))->put(str, str);
+        };
+        int ret = useBuckets ? db.updateBuckets(names, func) : db.update(func);
+        if (ret != 0) {
+          failed++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  uint64_t end = usec_now();
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  if (failed != 0) {
+    LOG(ERROR) << "test_tenant_buckets failed: " << failed;
+  }
+  LOG(WARNING) << "finishing test_tenant_buckets("
+               << (useBuckets ? "updateBuckets" : "update") << ", " << threads
+               << " threads) with " << max_recursion
+               << " recursion, time used(usec): " << end - begin;
+  LOG(WARNING) << "transaction per second: "
+               << max_recursion * 1000000 / (end - begin + 1);
+}
+
+// 比较freelist落盘和不落盘(NoFreelistSync)两种模式下小事务commit的耗时和重新打开db的耗时
+void test_freelist_sync_mode(bool noFreelistSync) {
+  Options options;
+  options.NoFreelistSync = noFreelistSync;
+  auto name = newFileName();
+  uint64_t commitIntervals = 0, openIntervals, begin;
+  {
+    DB db(name);
+    if (db.Open(options) != 0) {
+      LOG(ERROR) << "open DB failed!";
+      return;
+    }
+    db.update([](TxPtr tx)->int {
+      auto b = tx->createBucket(bucketname);
+      if (b == nullptr) {
+        return -1;
+      }
+      for (uint64_t i = 0; i < max_recursion; ++i) {
+        std::ostringstream ss;
+        ss << std::setw(8) << std::setfill('0') << i;
+        b->put(ss.str(), string(100, 'v'));
+      }
+      return 0;
+    });
+    // 随机覆盖写，每个事务都会free一些页，freelist越来越碎
+    for (uint64_t i = 0; i < max_recursion / 10; ++i) {
+      std::ostringstream ss;
+      ss << std::setw(8) << std::setfill('0') << (rand() % max_recursion);
+      Item key(ss.str());
+      begin = usec_now();
+      int ret = db.update([&key](TxPtr tx)->int {
+        return tx->getBucket(bucketname)->put(key, Item(string(100, 'w')));
+      });
+      commitIntervals += usec_now() - begin;
+      if (ret != 0) {
+        LOG(ERROR) << "test_freelist_sync_mode update failed!";
+      }
+    }
+    db.DbClose();
+  }
+  {
+    DB db(name);
+    begin = usec_now();
+    if (db.Open(options) != 0) {
+      LOG(ERROR) << "reopen DB failed!";
+      return;
+    }
+    openIntervals = usec_now() - begin;
+    LOG(WARNING) << "finishing test_freelist_sync_mode(NoFreelistSync="
+                 << noFreelistSync << ") with " << max_recursion
+                 << " keys, free pages: " << db.getFreeList()->freeCount();
+    db.DbClose();
+  }
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  LOG(WARNING) << "transaction per second: "
+               << (max_recursion / 10) * 1000000 / (commitIntervals + 1)
+               << ", open time used(usec): " << openIntervals;
+}
+
+// threads个线程各自用update写一条记录，比较普通提交和PipelinedCommit的TPS。
+// 一个线程时每次都要等落盘，流水线只能重叠写数据页和上一次的落盘
+void test_pipelined_commit(bool pipelined, int threads) {
+  Options options;
+  options.PipelinedCommit = pipelined;
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(options) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([](TxPtr tx)->int {
+    return tx->createBucket(bucketname) != nullptr ? 0 : -1;
+  });
+  std::atomic<uint64_t> failed(0);
+  std::vector<std::thread> workers;
+  uint64_t transactions = max_recursion / 10;
+  uint64_t begin = usec_now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&db, &failed, transactions, threads, t]() {
+      for (uint64_t i = t; i < transactions; i += threads) {
+        std::ostringstream ss;
+        ss << std::setw(8) << std::setfill('0') << (rand() % max_recursion);
+        Item key(ss.str());
+        int ret = db.update([&key](TxPtr tx)->int {
+          return tx->getBucket(bucketname)->put(key, key);
+        });
+        if (ret != 0) {
+          failed++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  uint64_t end = usec_now();
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  if (failed != 0) {
+    LOG(ERROR) << "test_pipelined_commit failed: " << failed;
+  }
+  LOG(WARNING) << "finishing test_pipelined_commit(PipelinedCommit="
+               << pipelined << ", " << threads << " threads) with "
+               << transactions << " transactions, time used(usec): "
+               << end - begin;
+  LOG(WARNING) << "transaction per second: "
+               << transactions * 1000000 / (end - begin + 1);
+}
+
+// 每个事务写一条记录，比较两次落盘和SingleSyncCommit一次落盘的TPS
+void test_single_sync_commit(bool singleSync) {
+  Options options;
+  options.SingleSyncCommit = singleSync;
+  auto name = newFileName();
+  uint64_t intervals = 0, begin;
+  {
+    DB db(name);
+    if (db.Open(options) != 0) {
+      LOG(ERROR) << "open DB failed!";
+      return;
+    }
+    db.update([](TxPtr tx)->int {
+      return tx->createBucket(bucketname) != nullptr ? 0 : -1;
+    });
+    for (uint64_t i = 0; i < max_recursion / 10; ++i) {
+      std::ostringstream ss;
+      ss << std::setw(8) << std::setfill('0') << (rand() % max_recursion);
+      Item key(ss.str());
+      begin = usec_now();
+      int ret = db.update([&key](TxPtr tx)->int {
+        return tx->getBucket(bucketname)->put(key, key);
+      });
+      intervals += usec_now() - begin;
+      if (ret != 0) {
+        LOG(ERROR) << "test_single_sync_commit update failed!";
+      }
+    }
+    db.DbClose();
+  }
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  LOG(WARNING) << "finishing test_single_sync_commit(SingleSyncCommit="
+               << singleSync << ") with " << max_recursion / 10
+               << " transactions, time used(usec): " << intervals;
+  LOG(WARNING) << "transaction per second: "
+               << (max_recursion / 10) * 1000000 / (intervals + 1);
+}
+
+// 用1MB的value把db写到targetGB以上(超过4GB, 即32位文件大小/mmap的上限)，
+// 再读回4GB之后的数据。文件随grow用ftruncate扩展，没写到的部分是稀疏的。
+void test_large_db_load(uint64_t targetGB) {
+  const uint64_t valueSize = 1 << 20;
+  const uint64_t valuesPerTx = 64;
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(Options()) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([](TxPtr tx)->int {
+    return tx->createBucket(bucketname) != nullptr ? 0 : -1;
+  });
+  std::string value(valueSize, 'v');
+  uint64_t count = 0, intervals = 0, begin;
+  while (GetFileSize(db.getFd()) < static_cast<long>(targetGB << 30)) {
+    begin = usec_now();
+    int ret = db.update([&](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      for (uint64_t i = 0; i < valuesPerTx; i++) {
+        std::ostringstream ss;
+        ss << std::setw(8) << std::setfill('0') << count + i;
+        if (b->put(Item(ss.str()), Item(value)) != 0) {
+          return -1;
+        }
+      }
+      return 0;
+    });
+    intervals += usec_now() - begin;
+    if (ret != 0) {
+      LOG(ERROR) << "test_large_db_load update failed at key " << count;
+      break;
+    }
+    count += valuesPerTx;
+  }
+  LOG(WARNING) << "finishing test_large_db_load with " << count
+               << " values, file size: " << GetFileSize(db.getFd())
+               << ", time used(usec): " << intervals;
+  LOG(WARNING) << "MB per second: " << count * 1000000 / (intervals + 1);
+
+  // 最后写入的key都在4GB之后
+  uint64_t found = 0;
+  db.view([&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    for (uint64_t i = count - valuesPerTx; i < count; i++) {
+      std::ostringstream ss;
+      ss << std::setw(8) << std::setfill('0') << i;
+      auto item = b->get(Item(ss.str()));
+      if (item.length_ == valueSize && item.data()[valueSize - 1] == 'v') {
+        found++;
+      }
+    }
+    return 0;
+  });
+  LOG(WARNING) << "read back " << found << "/" << valuesPerTx
+               << " values beyond 4GB";
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+}
+
+// 持续写入让db不断变大，同时另一个线程不停的读，统计读事务的延时分布。
+// 不预留地址空间时每次重新映射都要等所有读事务结束，读会被卡住
+void test_read_latency_during_load(bool reserve) {
+  Options options;
+  if (reserve) {
+    options.MmapReserveSize = 1ULL << 32;
+  }
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(options) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([](TxPtr tx)->int {
+    auto b = tx->createBucket(bucketname);
+    return b != nullptr ? b->put(Item(string("foo")), Item(string("bar")))
+                        : -1;
+  });
+  std::atomic<bool> done(false);
+  std::vector<uint64_t> latencies;
+  std::thread reader([&db, &done, &latencies]() {
+    while (!done) {
+      auto begin = usec_now();
+      db.view([](TxPtr tx)->int {
+        return tx->getBucket(bucketname)->get(Item(string("foo"))).empty()
+                   ? -1
+                   : 0;
+      });
+      latencies.push_back(usec_now() - begin);
+    }
+  });
+  std::string value(64 * 1024, 'v');
+  uint64_t begin = usec_now();
+  for (uint64_t i = 0; i < max_recursion / 10; ++i) {
+    int ret = db.update([&value, i](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      for (int j = 0; j < 16; j++) {
+        std::ostringstream ss;
+        ss << std::setw(8) << std::setfill('0') << i * 16 + j;
+        if (b->put(Item(ss.str()), Item(value)) != 0) {
+          return -1;
+        }
+      }
+      return 0;
+    });
+    if (ret != 0) {
+      LOG(ERROR) << "test_read_latency_during_load update failed!";
+      break;
+    }
+  }
+  uint64_t intervals = usec_now() - begin;
+  done = true;
+  reader.join();
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  if (latencies.empty()) {
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+  };
+  LOG(WARNING) << "finishing test_read_latency_during_load(MmapReserveSize="
+               << options.MmapReserveSize << ") with " << max_recursion / 10
+               << " transactions, time used(usec): " << intervals;
+  LOG(WARNING) << "reads: " << latencies.size()
+               << ", latency(usec) p50: " << percentile(0.5)
+               << ", p99: " << percentile(0.99)
+               << ", p99.9: " << percentile(0.999)
+               << ", max: " << latencies.back();
+}
+
+// 每个线程不停地开启/关闭只读事务并查一条记录，统计1到64个线程下每秒的读事务数
+void test_read_transaction_scalability(std::shared_ptr<DB> db) {
+  const uint64_t txPerThread = max_recursion / 10 + 1;
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    std::atomic<uint64_t> failed(0);
+    std::vector<std::thread> workers;
+    uint64_t begin = usec_now();
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back([db, txPerThread, &failed, t]() {
+        // rand()有全局锁，会把线程串行起来
+        std::mt19937 gen(t);
+        for (uint64_t i = 0; i < txPerThread; ++i) {
+          std::ostringstream ss;
+          ss << std::setw(8) << std::setfill('0') << (gen() % max_recursion);
+          int ret = db->view([&ss](TxPtr tx)->int {
+            tx->getBucket(bucketname)->get(Item(ss.str()));
+            return 0;
+          });
+          if (ret != 0) {
+            failed++;
+          }
+        }
+      });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    uint64_t end = usec_now();
+    if (failed != 0) {
+      LOG(ERROR) << "test_read_transaction_scalability failed: " << failed;
+    }
+    LOG(WARNING) << "finishing test_read_transaction_scalability(" << threads
+                 << " threads) with " << txPerThread * threads
+                 << " transactions, time used(usec): " << end - begin;
+    LOG(WARNING) << "read transaction per second: "
+                 << txPerThread * threads * 1000000 / (end - begin + 1);
+  }
+}
+
+// 每个事务插入很多条记录，产生大量脏页，统计写盘的系统调用次数和吞吐。
+// 每个脏页单独pwrite时系统调用次数等于分配的页数
+void test_large_commit_writeback(std::shared_ptr<DB> db) {
+  uint64_t pageCount = 0, writeCount = 0, bytes = 0, intervals = 0;
+  const uint64_t keysPerTx = 10000;
+  for (uint64_t i = 0; i < max_recursion / keysPerTx + 1; ++i) {
+    uint64_t begin = usec_now();
+    int ret = db->update([&](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      for (uint64_t j = 0; j < keysPerTx; ++j) {
+        std::ostringstream ss;
+        ss << std::setw(8) << std::setfill('0') << rand() % max_recursion;
+        if (b->put(Item(ss.str()), Item(string(100, 'w'))) != 0) {
+          return -1;
+        }
+      }
+      auto raw = tx.get();
+      tx->addCommitHandle([&, raw]() {
+        pageCount += raw->getStats().pageCount;
+        writeCount += raw->getStats().writeCount;
+        bytes += raw->getStats().pageAlloc;
+      });
+      return 0;
+    });
+    intervals += usec_now() - begin;
+    if (ret != 0) {
+      LOG(ERROR) << "test_large_commit_writeback update failed!";
+      return;
+    }
+  }
+  LOG(WARNING) << "finishing test_large_commit_writeback with "
+               << max_recursion / keysPerTx + 1 << " transactions of "
+               << keysPerTx << " keys, time used(usec): " << intervals;
+  LOG(WARNING) << "dirty pages: " << pageCount
+               << ", write requests: " << writeCount
+               << ", MB per second: " << bytes / (intervals + 1);
+}
+
+// 同样的大事务，比较默认的pwritev和io_uring落盘
+void test_uring_commit(bool ioUring) {
+  Options options;
+  options.IoUring = ioUring;
+  auto name = newFileName();
+  auto db = make_shared<DB>(name);
+  if (db->Open(options) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db->update([](TxPtr tx)->int {
+    return tx->createBucket(bucketname) != nullptr ? 0 : -1;
+  });
+  LOG(WARNING) << "test_uring_commit(IoUring=" << ioUring << ")";
+  test_large_commit_writeback(db);
+  db->DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+}
+
+// 文件[offset, offset + length)在page cache里的页数
+uint64_t cached_pages(int fd, uint64_t offset, uint64_t length) {
+  auto pageSize = getpagesize();
+  if (length == 0) {
+    return 0;
+  }
+  auto ptr = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, offset);
+  if (ptr == MAP_FAILED) {
+    return 0;
+  }
+  std::vector<unsigned char> vec((length + pageSize - 1) / pageSize);
+  uint64_t count = 0;
+  if (::mincore(ptr, length, vec.data()) == 0) {
+    for (auto v : vec) {
+      count += v & 1;
+    }
+  }
+  ::munmap(ptr, length);
+  return count;
+}
+
+// 先写入并读一遍读的数据集，再做一批大事务，看读数据集和新写的数据各有多少页在page cache里。
+// 普通写会把新写的页都留在page cache里，内存紧张时就会挤掉读数据集
+void test_direct_io_residency(bool directIO) {
+  Options options;
+  options.DirectIO = directIO;
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(options) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([](TxPtr tx)->int {
+    auto b = tx->createBucket(bucketname);
+    for (uint64_t i = 0; i < max_recursion; ++i) {
+      std::ostringstream ss;
+      ss << std::setw(8) << std::setfill('0') << i;
+      if (b->put(Item(ss.str()), Item(string(100, 'r'))) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+  });
+  uint64_t readSetSize = GetFileSize(db.getFd());
+  db.view([](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    for (uint64_t i = 0; i < max_recursion; ++i) {
+      std::ostringstream ss;
+      ss << std::setw(8) << std::setfill('0') << i;
+      b->get(Item(ss.str()));
+    }
+    return 0;
+  });
+  auto before = cached_pages(db.getFd(), 0, readSetSize);
+
+  std::string value(64 * 1024, 'w');
+  uint64_t begin = usec_now(), commits = 16;
+  for (uint64_t i = 0; i < commits; ++i) {
+    int ret = db.update([&value, i](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      for (int j = 0; j < 256; j++) {
+        std::ostringstream ss;
+        ss << "w" << std::setw(8) << std::setfill('0') << i * 256 + j;
+        if (b->put(Item(ss.str()), Item(value)) != 0) {
+          return -1;
+        }
+      }
+      return 0;
+    });
+    if (ret != 0) {
+      LOG(ERROR) << "test_direct_io_residency update failed!";
+      break;
+    }
+  }
+  uint64_t intervals = usec_now() - begin;
+  uint64_t fileSize = GetFileSize(db.getFd());
+  auto after = cached_pages(db.getFd(), 0, readSetSize);
+  auto burst = cached_pages(db.getFd(), readSetSize, fileSize - readSetSize);
+  LOG(WARNING) << "finishing test_direct_io_residency(DirectIO=" << directIO
+               << ") with " << commits << " commits of 16MB, time used(usec): "
+               << intervals << ", MB per second: "
+               << commits * 16 * 1000000 / (intervals + 1);
+  LOG(WARNING) << "read set cached pages before: " << before
+               << ", after: " << after
+               << ", pages cached by the write burst: " << burst << "/"
+               << (fileSize - readSetSize) / getpagesize();
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+}
+
+// 每个事务写256KB，文件一直在变大，统计提交延时的分布。
+// 不开PreGrow时每隔几个提交就要在提交里扩展文件并fsync
+void test_commit_latency_during_growth(bool preGrow) {
+  Options options;
+  options.AllocSize = 4 << 20;
+  options.PreGrow = preGrow;
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(options) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([](TxPtr tx)->int {
+    return tx->createBucket(bucketname) != nullptr ? 0 : -1;
+  });
+  std::string value(16 * 1024, 'g');
+  std::vector<uint64_t> latencies;
+  for (uint64_t i = 0; i < max_recursion / 10; ++i) {
+    uint64_t begin = usec_now();
+    int ret = db.update([&value, i](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      for (int j = 0; j < 16; j++) {
+        std::ostringstream ss;
+        ss << std::setw(8) << std::setfill('0') << i * 16 + j;
+        if (b->put(Item(ss.str()), Item(value)) != 0) {
+          return -1;
+        }
+      }
+      return 0;
+    });
+    latencies.push_back(usec_now() - begin);
+    if (ret != 0) {
+      LOG(ERROR) << "test_commit_latency_during_growth update failed!";
+      break;
+    }
+  }
+  auto fileSize = GetFileSize(db.getFd());
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  if (latencies.empty()) {
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+  };
+  LOG(WARNING) << "finishing test_commit_latency_during_growth(PreGrow="
+               << preGrow << ") with " << latencies.size()
+               << " transactions, file size: " << fileSize;
+  LOG(WARNING) << "commit latency(usec) p50: " << percentile(0.5)
+               << ", p99: " << percentile(0.99)
+               << ", max: " << latencies.back();
+}
+
+// 一个事务里按顺序导入keys个8字节的key，比较逐个put和bulkLoad的导入速度和文件大小
+void test_bulk_load(bool bulk, uint64_t keys) {
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(Options()) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  uint64_t begin = usec_now();
+  int ret = db.update([bulk, keys](TxPtr tx)->int {
+    auto b = tx->createBucket(bucketname);
+    if (b == nullptr) {
+      return -1;
+    }
+    char buf[24];
+    if (bulk) {
+      uint64_t i = 0;
+      return b->bulkLoad([&i, &buf, keys](Item &key, Item &value) {
+        if (i == keys) {
+          return false;
+        }
+        snprintf(buf, sizeof(buf), "%08lu", i++);
+        key = Item(buf, 8);
+        value = key;
+        return true;
+      });
+    }
+    for (uint64_t i = 0; i < keys; ++i) {
+      snprintf(buf, sizeof(buf), "%08lu", i);
+      Item key(buf, 8);
+      if (b->put(key, key) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+  });
+  uint64_t end = usec_now();
+  auto fileSize = GetFileSize(db.getFd());
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  if (ret != 0) {
+    LOG(ERROR) << "test_bulk_load failed!";
+    return;
+  }
+  LOG(WARNING) << "finishing test_bulk_load(bulkLoad=" << bulk << ") with "
+               << keys << " keys, time used(usec): " << end - begin
+               << ", file size: " << fileSize;
+  LOG(WARNING) << "keys per second: " << keys * 1000000 / (end - begin + 1);
+}
+
+// 时序数据式的顺序追加，每个事务追加1000个key，比较按追加分裂和固定DEFAULTFILLPERCENT分裂的
+// 文件大小和全量扫描速度
+void test_sequential_append(bool fixedFill, uint64_t transactions) {
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(Options()) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([](TxPtr tx)->int {
+    return tx->createBucket(bucketname) != nullptr ? 0 : -1;
+  });
+  uint64_t begin = usec_now();
+  for (uint64_t t = 0; t < transactions; ++t) {
+    int ret = db.update([fixedFill, t](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      if (fixedFill) {
+        b->setFillPercent(DEFAULTFILLPERCENT);
+      }
+      char buf[24];
+      for (uint64_t i = t * 1000; i < (t + 1) * 1000; ++i) {
+        snprintf(buf, sizeof(buf), "%08lu", i);
+        if (b->put(Item(buf, 8), Item(std::string(16, 'v'))) != 0) {
+          return -1;
+        }
+      }
+      return 0;
+    });
+    if (ret != 0) {
+      LOG(ERROR) << "test_sequential_append update failed!";
+      break;
+    }
+  }
+  uint64_t loaded = usec_now();
+  uint64_t scanned = 0;
+  db.view([&scanned](TxPtr tx)->int {
+    auto c = tx->getBucket(bucketname)->createCursor();
+    Item key;
+    Item value;
+    for (c->first(key, value); !key.empty(); c->next(key, value)) {
+      scanned++;
+    }
+    return 0;
+  });
+  uint64_t end = usec_now();
+  auto pages = db.getMeta()->totalPageNumber_;
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  LOG(WARNING) << "finishing test_sequential_append(fixedFill=" << fixedFill
+               << ") with " << transactions * 1000
+               << " keys, load time(usec): " << loaded - begin
+               << ", pages: " << pages;
+  LOG(WARNING) << "scanned " << scanned << " keys, scan time(usec): "
+               << end - loaded << ", keys per second: "
+               << scanned * 1000000 / (end - loaded + 1);
+}
+
+// 一个事务里顺序put keys个key，只统计put的时间(不含提交)，和memcpy同样多的数据对比
+void test_append_ingest(uint64_t keys) {
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(Options()) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  std::string value(16, 'v');
+  uint64_t putTime = 0;
+  int ret = db.update([&value, &putTime, keys](TxPtr tx)->int {
+    auto b = tx->createBucket(bucketname);
+    if (b == nullptr) {
+      return -1;
+    }
+    char buf[24];
+    uint64_t begin = usec_now();
+    for (uint64_t i = 0; i < keys; ++i) {
+      snprintf(buf, sizeof(buf), "%08lu", i);
+      if (b->put(Item(buf, 8), Item(value)) != 0) {
+        return -1;
+      }
+    }
+    putTime = usec_now() - begin;
+    return 0;
+  });
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  if (ret != 0) {
+    LOG(ERROR) << "test_append_ingest failed!";
+    return;
+  }
+  std::vector<char> src(keys * (8 + value.size()), 'v');
+  std::vector<char> dst(src.size());
+  uint64_t begin = usec_now();
+  memcpy(dst.data(), src.data(), src.size());
+  uint64_t copyTime = usec_now() - begin;
+  LOG(WARNING) << "finishing test_append_ingest with " << keys
+               << " keys, put time(usec): " << putTime
+               << ", keys per second: " << keys * 1000000 / (putTime + 1);
+  LOG(WARNING) << "memcpy of " << src.size() << " bytes(usec): " << copyTime
+               << ", check: " << dst[src.size() / 2];
+}
+
+// 带长公共前缀的key("tenant-xxxx/table-orders/序号")，统计每个key占的字节数、树的高度和
+// 随机查找的延时
+void test_prefix_keys(uint64_t keys) {
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(Options()) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([](TxPtr tx)->int {
+    return tx->createBucket(bucketname) != nullptr ? 0 : -1;
+  });
+  auto keyOf = [](uint64_t i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "tenant-%04lu/table-orders/%08lu", i / 100000,
+             i % 100000);
+    return std::string(buf);
+  };
+  for (uint64_t begin = 0; begin < keys; begin += 10000) {
+    int ret = db.update([&keyOf, begin, keys](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      for (uint64_t i = begin; i < std::min(begin + 10000, keys); ++i) {
+        if (b->put(Item(keyOf(i)), Item(std::string(8, 'v'))) != 0) {
+          return -1;
+        }
+      }
+      return 0;
+    });
+    if (ret != 0) {
+      LOG(ERROR) << "test_prefix_keys update failed!";
+      return;
+    }
+  }
+  auto pages = db.getMeta()->totalPageNumber_ - db.getFreeList()->freeCount();
+  uint64_t depth = 0;
+  uint64_t lookupTime = 0;
+  uint64_t lookups = std::min<uint64_t>(keys, 1000000);
+  db.view([&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    auto page = tx->getPage(b->getRootPage());
+    for (depth = 1; page->flag & pageFlags::branchPageFlag; depth++) {
+      page = tx->getPage(page->getBranchPageElement(0)->pageId);
+    }
+    std::vector<Item> targets;
+    for (uint64_t i = 0; i < lookups; ++i) {
+      targets.emplace_back(keyOf(rand() % keys));
+    }
+    uint64_t begin = usec_now();
+    for (auto &key : targets) {
+      if (b->get(key).empty()) {
+        LOG(ERROR) << "lookup failed!" << key.toString();
+        return -1;
+      }
+    }
+    lookupTime = usec_now() - begin;
+    return 0;
+  });
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  LOG(WARNING) << "finishing test_prefix_keys with " << keys
+               << " keys, pages: " << pages << ", bytes per key: "
+               << pages * db.getPageSize() / keys << ", depth: " << depth;
+  LOG(WARNING) << "random lookup latency(nsec): "
+               << lookupTime * 1000 / (lookups + 1);
+}
+
+// keySize字节的长key，随机顺序写入，统计树的高度、branch页数和随机查找的延时
+void test_long_keys(uint32_t keySize, uint64_t keys) {
+  auto name = newFileName();
+  DB db(name);
+  if (db.Open(Options()) != 0) {
+    LOG(ERROR) << "open DB failed!";
+    return;
+  }
+  db.update([](TxPtr tx)->int {
+    return tx->createBucket(bucketname) != nullptr ? 0 : -1;
+  });
+  // 前16个字节是打散的序号，后面补齐到keySize
+  auto keyOf = [keySize](uint64_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016lx",
+             static_cast<uint64_t>(i * 0x9E3779B97F4A7C15ULL));
+    std::string key(buf);
+    key.resize(keySize, 'k');
+    return key;
+  };
+  for (uint64_t begin = 0; begin < keys; begin += 10000) {
+    int ret = db.update([&keyOf, begin, keys](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      for (uint64_t i = begin; i < std::min(begin + 10000, keys); ++i) {
+        if (b->put(Item(keyOf(i)), Item(std::string(8, 'v'))) != 0) {
+          return -1;
+        }
+      }
+      return 0;
+    });
+    if (ret != 0) {
+      LOG(ERROR) << "test_long_keys update failed!";
+      return;
+    }
+  }
+  uint64_t depth = 0;
+  uint64_t branchPages = 0;
+  uint64_t lookupTime = 0;
+  uint64_t lookups = std::min<uint64_t>(keys, 1000000);
+  db.view([&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    std::vector<pgid> level{ b->getRootPage() };
+    while (!level.empty()) {
+      depth++;
+      std::vector<pgid> next;
+      for (auto id : level) {
+        auto page = tx->getPage(id);
+        if (!(page->flag & pageFlags::branchPageFlag)) {
+          continue;
+        }
+        branchPages++;
+        for (uint32_t i = 0; i < page->count; i++) {
+          next.push_back(page->getBranchPageElement(i)->pageId);
+        }
+      }
+      level.swap(next);
+    }
+    std::vector<Item> targets;
+    for (uint64_t i = 0; i < lookups; ++i) {
+      targets.emplace_back(keyOf(rand() % keys));
+    }
+    uint64_t begin = usec_now();
+    for (auto &key : targets) {
+      if (b->get(key).empty()) {
+        LOG(ERROR) << "lookup failed!" << key.toString();
+        return -1;
+      }
+    }
+    lookupTime = usec_now() - begin;
+    return 0;
+  });
+  db.DbClose();
+  ::unlink(name.c_str());
+  ::unlink((name + "_lock").c_str());
+  LOG(WARNING) << "finishing test_long_keys(" << keySize << " bytes) with "
+               << keys << " keys, depth: " << depth
+               << ", branch pages: " << branchPages;
+  LOG(WARNING) << "random lookup latency(nsec): "
+               << lookupTime * 1000 / (lookups + 1);
+}
+
 GTEST_API_ int main(int argc, char **argv) {
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = true; //设置日志消息是否转到标准输出而不是日志文件
@@ -218,6 +1331,11 @@ GTEST_API_ int main(int argc, char **argv) {
     max_recursion = atoi(argv[1]);
     LOG(INFO) << "set max recursion: " << max_recursion;
   }
+  // 第二个参数指定大库测试的目标大小(GB)，默认不跑
+  uint64_t largeDbGB = 0;
+  if (argc >= 3) {
+    largeDbGB = atoi(argv[2]);
+  }
 
   /* initialize random seed: */
   srand(time(NULL));
@@ -239,8 +1357,8 @@ GTEST_API_ int main(int argc, char **argv) {
     LOG(FATAL) << "create bucket failed!";
     return -1;
   }
-  // LOG(WARNING) << "test_8byte_random_insertion.";
-  // test_8byte_random_insertion(db);
+  LOG(WARNING) << "test_8byte_random_insertion.";
+  test_8byte_random_insertion(db);
   // LOG(WARNING) << "test_8byte_random_transaction.";
   // test_8byte_random_transaction(db);
   LOG(WARNING) << "test_8byte_seq_insertion.";
@@ -249,6 +1367,68 @@ GTEST_API_ int main(int argc, char **argv) {
   // test_8byte_seq_transaction(db);
   LOG(WARNING) << "test_8byte_query_transaction.";
   test_8byte_query_transaction(db);
+  LOG(WARNING) << "test_8byte_random_lookup.";
+  test_8byte_random_lookup(db);
+  LOG(WARNING) << "test_small_value_commit.";
+  test_small_value_commit(db);
+  LOG(WARNING) << "test_large_commit_writeback.";
+  test_large_commit_writeback(db);
+  LOG(WARNING) << "test_uring_commit.";
+  test_uring_commit(false);
+  test_uring_commit(true);
+  LOG(WARNING) << "test_direct_io_residency.";
+  test_direct_io_residency(false);
+  test_direct_io_residency(true);
+  LOG(WARNING) << "test_commit_latency_during_growth.";
+  test_commit_latency_during_growth(false);
+  test_commit_latency_during_growth(true);
+  LOG(WARNING) << "test_read_transaction_scalability.";
+  test_read_transaction_scalability(db);
+  LOG(WARNING) << "test_concurrent_transaction.";
+  test_concurrent_transaction(db, false, 8);
+  test_concurrent_transaction(db, true, 8);
+  LOG(WARNING) << "test_optimistic_contention.";
+  for (double theta : { 0.0, 0.99, 1.5 }) {
+    test_optimistic_contention(false, theta, 8);
+    test_optimistic_contention(true, theta, 8);
+  }
+  LOG(WARNING) << "test_tenant_buckets.";
+  test_tenant_buckets(false, 8);
+  test_tenant_buckets(true, 8);
+  LOG(WARNING) << "test_freelist_fragmentation.";
+  test_freelist_fragmentation();
+  LOG(WARNING) << "test_freelist_sync_mode.";
+  test_freelist_sync_mode(false);
+  test_freelist_sync_mode(true);
+  LOG(WARNING) << "test_single_sync_commit.";
+  test_single_sync_commit(false);
+  test_single_sync_commit(true);
+  LOG(WARNING) << "test_pipelined_commit.";
+  for (int threads : { 1, 8 }) {
+    test_pipelined_commit(false, threads);
+    test_pipelined_commit(true, threads);
+  }
+  LOG(WARNING) << "test_read_latency_during_load.";
+  test_read_latency_during_load(false);
+  test_read_latency_during_load(true);
+  LOG(WARNING) << "test_bulk_load.";
+  test_bulk_load(false, max_recursion * 100);
+  test_bulk_load(true, max_recursion * 100);
+  LOG(WARNING) << "test_sequential_append.";
+  test_sequential_append(true, max_recursion / 10);
+  test_sequential_append(false, max_recursion / 10);
+  LOG(WARNING) << "test_append_ingest.";
+  test_append_ingest(max_recursion * 100);
+  LOG(WARNING) << "test_prefix_keys.";
+  test_prefix_keys(max_recursion * 100);
+  LOG(WARNING) << "test_long_keys.";
+  for (uint32_t keySize : { 64, 128, 256 }) {
+    test_long_keys(keySize, max_recursion * 100);
+  }
+  if (largeDbGB > 0) {
+    LOG(WARNING) << "test_large_db_load.";
+    test_large_db_load(largeDbGB);
+  }
 
   db->DbClose();
   return 0;
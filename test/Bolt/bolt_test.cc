@@ -4,6 +4,8 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <iostream>
+#include <map>
+#include <set>
 #include "db.h"
 #include "testBase.h"
 
@@ -16,6 +18,38 @@ TEST(dbtest, opentest) {
   ptr->DbClose();
 }
 
+// only version 1 metas may be written without a checksum
+TEST(dbtest, meta_validate_test) {
+  std::unique_ptr<DB> db(new DB(newFileName()));
+  EXPECT_EQ(db->Open(Options()), 0);
+  meta m = *db->getMeta();
+  db->DbClose();
+  EXPECT_EQ(m.version_, VERSION);
+  EXPECT_TRUE(m.validate());
+  m.txid_++;
+  EXPECT_FALSE(m.validate());
+  m.checksum_ = 0;
+  EXPECT_FALSE(m.validate());
+  m.version_ = 1;
+  EXPECT_TRUE(m.validate());
+  m.checksum_ = m.sum64() + 1;
+  EXPECT_FALSE(m.validate());
+
+  // transactions fail instead of crashing once neither meta is valid
+  db.reset(new DB(newFileName()));
+  EXPECT_EQ(db->Open(Options()), 0);
+  std::string zero(db->getPageSize() * 2, '\0');
+  EXPECT_EQ(pwrite(db->getFd(), zero.data(), zero.size(), 0),
+            static_cast<ssize_t>(zero.size()));
+  EXPECT_EQ(db->getMeta(), nullptr);
+  EXPECT_EQ(db->beginTx(), nullptr);
+  EXPECT_EQ(db->beginRWTx(), nullptr);
+  std::function<int(TxPtr)> viewFunc = [](TxPtr tx)->int { return 0; };
+  EXPECT_EQ(db->view(viewFunc), -1);
+  EXPECT_EQ(db->update(viewFunc), -1);
+  db->DbClose();
+}
+
 // //re-open a db
 // TEST(dbtest, dbtest_reopendb_Test) {
 //   auto name = newFileName();
@@ -41,7 +75,7 @@ TEST(dbtest, opentest) {
 // }
 
 // test freeList Function free() can adding accord page to pending_
-// and release() can release it to ids_
+// and release() can release it to the free extents
 // and allocate() can get contigious pages
 TEST(dbtest, freeListTest) {
   std::unique_ptr<freeList> f(new freeList());
@@ -54,7 +88,8 @@ TEST(dbtest, freeListTest) {
     EXPECT_EQ(index + i, *it++);
   }
   f->release(100);
-  auto it_ids = f->ids_.begin();
+  auto ids = f->freePageIds();
+  auto it_ids = ids.begin();
   for (uint32_t i = 0; i <= overflow; i++) {
     EXPECT_EQ(index + i, *it_ids++);
   }
@@ -62,6 +97,50 @@ TEST(dbtest, freeListTest) {
   EXPECT_EQ(pg, index);
 }
 
+// freelist above 0xffff entries is written across several contiguous pages
+// and read back with the same free and pending pages.
+TEST(dbtest, freeListSerializeTest) {
+  std::unique_ptr<freeList> f(new freeList());
+  const uint32_t pageSize = 4096;
+  txid tx = 1;
+  pgid id = 2;
+  // runs of 1~4 pages with holes in between, 200K free pages in total
+  while (f->count() < 200000) {
+    uint32_t len = id % 4 + 1;
+    Page p{ .id = id, .flag = 0, .count = 0, .overflow = len - 1 };
+    f->free(tx, &p);
+    id += len + 1;
+  }
+  f->release(tx++);
+  Page pending{ .id = id + 10, .flag = 0, .count = 0, .overflow = 2 };
+  f->free(tx, &pending);
+
+  uint32_t pages = (f->size() + pageSize - 1) / pageSize;
+  EXPECT_LT(f->size(), f->count() * sizeof(pgid));
+  std::vector<char> buf(pages * pageSize);
+  auto page = reinterpret_cast<Page *>(buf.data());
+  page->id = 100;
+  page->overflow = pages - 1;
+  EXPECT_EQ(f->write(page, pageSize), 0);
+
+  std::unique_ptr<freeList> f2(new freeList());
+  f2->read(page);
+  EXPECT_EQ(f2->count(), f->count());
+  auto ids = f->freePageIds();
+  for (pgid i = 0; i <= pending.overflow; i++) {
+    ids.push_back(pending.id + i);
+  }
+  EXPECT_EQ(f2->freePageIds(), ids);
+
+  // pages still pending are dropped by reload()
+  f->reload(page);
+  EXPECT_EQ(f->freeCount(), ids.size() - pending.overflow - 1);
+
+  // too small a page is rejected instead of overflowing
+  page->overflow = 0;
+  EXPECT_EQ(f->write(page, pageSize), -1);
+}
+
 // --gtest_catch_exceptions=0
 TEST(dbtest, start_transaction) {
   std::unique_ptr<DB> db(new DB(newFileName()));
@@ -255,3 +334,1203 @@ TEST(dbtest, update_query_entry_test) {
   EXPECT_EQ(ret, 0);
   db->DbClose();
 }
+
+// with NoFreelistSync the freelist is not written on commit, reopening the db
+// walks the tree and finds the same free pages.
+TEST(dbtest, no_freelist_sync_test) {
+  Item bucketname(string("roland_test"));
+  auto name = newFileName();
+  Options options;
+  options.NoFreelistSync = true;
+  std::vector<pgid> freeIds;
+  {
+    std::unique_ptr<DB> db(new DB(name));
+    int ret = db->Open(options);
+    EXPECT_EQ(ret, 0);
+    std::function<int(TxPtr)> func = [&bucketname](TxPtr tx)->int {
+      auto b = tx->createBucket(bucketname);
+      EXPECT_NE(b, nullptr);
+      for (int i = 0; i < 1000; i++) {
+        b->put(Item(std::to_string(i)), Item(string(100, 'v')));
+      }
+      return 0;
+    };
+    ret = db->update(func);
+    EXPECT_EQ(ret, 0);
+    // overwrite some keys so old pages become free
+    for (int r = 0; r < 3; r++) {
+      std::function<int(TxPtr)> overwrite = [&bucketname, r](TxPtr tx)->int {
+        auto b = tx->getBucket(bucketname);
+        for (int i = r; i < 1000; i += 50) {
+          b->put(Item(std::to_string(i)), Item(string(100, 'w')));
+        }
+        return 0;
+      };
+      ret = db->update(overwrite);
+      EXPECT_EQ(ret, 0);
+    }
+    EXPECT_FALSE(db->hasSyncedFreelist());
+    freeIds = db->getFreeList()->freePageIds();
+    // pending pages of the last commit are free once nothing reads them
+    for (auto &item : db->getFreeList()->pending_) {
+      freeIds.insert(freeIds.end(), item.second.begin(), item.second.end());
+    }
+    std::sort(freeIds.begin(), freeIds.end());
+    EXPECT_FALSE(freeIds.empty());
+    db->DbClose();
+  }
+  std::unique_ptr<DB> db(new DB(name));
+  int ret = db->Open(options);
+  EXPECT_EQ(ret, 0);
+  EXPECT_EQ(db->getFreeList()->freePageIds(), freeIds);
+  std::function<int(TxPtr)> viewFunc = [&bucketname](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    EXPECT_NE(b, nullptr);
+    EXPECT_EQ(b->get(Item(string("0"))), Item(string(100, 'w')));
+    EXPECT_EQ(b->get(Item(string("999"))), Item(string(100, 'v')));
+    return 0;
+  };
+  ret = db->view(viewFunc);
+  EXPECT_EQ(ret, 0);
+  db->DbClose();
+}
+
+// concurrent batch() calls share transactions, a failing fn is retried on
+// its own and does not take the others down with it.
+TEST(dbtest, batch_test) {
+  Item bucketname(string("roland_test"));
+  std::unique_ptr<DB> db(new DB(newFileName()));
+  int ret = db->Open(Options());
+  EXPECT_EQ(ret, 0);
+  std::function<int(TxPtr)> func = [&bucketname](TxPtr tx)->int {
+    return tx->createBucket(bucketname) != nullptr ? 0 : -1;
+  };
+  ret = db->update(func);
+  EXPECT_EQ(ret, 0);
+
+  const int threads = 8, perThread = 50;
+  std::vector<int> results(threads * perThread, 0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      for (int i = t * perThread; i < (t + 1) * perThread; i++) {
+        std::function<int(TxPtr)> put = [&bucketname, i](TxPtr tx)->int {
+          if (i % 37 == 0) {
+            return -1;
+          }
+          auto key = Item(std::to_string(i));
+          return tx->getBucket(bucketname)->put(key, key);
+        };
+        results[i] = db->batch(put);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    for (int i = 0; i < threads * perThread; i++) {
+      auto key = Item(std::to_string(i));
+      if (i % 37 == 0) {
+        EXPECT_EQ(results[i], -1);
+        EXPECT_TRUE(b->get(key).empty());
+      } else {
+        EXPECT_EQ(results[i], 0);
+        EXPECT_EQ(b->get(key), key);
+      }
+    }
+    return 0;
+  };
+  ret = db->view(viewFunc);
+  EXPECT_EQ(ret, 0);
+  db->DbClose();
+}
+
+// SingleSyncCommit syncs data pages and meta together. If a page written by
+// the last commit did not make it to disk, reopening falls back to the
+// previous meta.
+TEST(dbtest, single_sync_commit_test) {
+  Item bucketname(string("roland_test"));
+  auto name = newFileName();
+  Options options;
+  options.SingleSyncCommit = true;
+  {
+    std::unique_ptr<DB> db(new DB(name));
+    int ret = db->Open(options);
+    EXPECT_EQ(ret, 0);
+    std::function<int(TxPtr)> first = [&bucketname](TxPtr tx)->int {
+      auto b = tx->createBucket(bucketname);
+      return b->put(Item(string("foo")), Item(string("1")));
+    };
+    ret = db->update(first);
+    EXPECT_EQ(ret, 0);
+    std::function<int(TxPtr)> second = [&bucketname](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      return b->put(Item(string("bar")), Item(string("2")));
+    };
+    ret = db->update(second);
+    EXPECT_EQ(ret, 0);
+    EXPECT_TRUE(db->getMeta()->flags_ & METASINGLESYNC);
+    db->DbClose();
+  }
+  {
+    // reopening a cleanly written file keeps the last commit
+    std::unique_ptr<DB> db(new DB(name));
+    EXPECT_EQ(db->Open(options), 0);
+    std::function<int(TxPtr)> viewFunc = [&bucketname](TxPtr tx)->int {
+      EXPECT_EQ(tx->getBucket(bucketname)->get(Item(string("bar"))),
+                Item(string("2")));
+      return 0;
+    };
+    EXPECT_EQ(db->view(viewFunc), 0);
+    db->DbClose();
+  }
+
+  // tear the first page written by the last commit
+  int fd = ::open(name.c_str(), O_RDWR);
+  const uint32_t pageSize = getpagesize();
+  std::vector<char> buf(pageSize * 2);
+  EXPECT_EQ(::pread(fd, buf.data(), buf.size(), 0), (ssize_t)buf.size());
+  auto m0 = reinterpret_cast<Page *>(buf.data())->metaPtr();
+  auto m1 = reinterpret_cast<Page *>(buf.data() + pageSize)->metaPtr();
+  auto newest = m0->txid_ > m1->txid_ ? m0 : m1;
+  auto record = reinterpret_cast<metaPageRecord *>(newest + 1);
+  EXPECT_GT(record->count, 0u);
+  std::vector<char> garbage(pageSize, 'x');
+  EXPECT_EQ(::pwrite(fd, garbage.data(), pageSize,
+                     record->extents[0].id * pageSize),
+            (ssize_t)pageSize);
+  ::close(fd);
+
+  std::unique_ptr<DB> db(new DB(name));
+  int ret = db->Open(options);
+  EXPECT_EQ(ret, 0);
+  std::function<int(TxPtr)> viewFunc = [&bucketname](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    EXPECT_NE(b, nullptr);
+    EXPECT_EQ(b->get(Item(string("foo"))), Item(string("1")));
+    EXPECT_TRUE(b->get(Item(string("bar"))).empty());
+    return 0;
+  };
+  ret = db->view(viewFunc);
+  EXPECT_EQ(ret, 0);
+  // the next commit takes over the rejected meta's slot
+  std::function<int(TxPtr)> third = [&bucketname](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    return b->put(Item(string("baz")), Item(string("3")));
+  };
+  ret = db->update(third);
+  EXPECT_EQ(ret, 0);
+  std::function<int(TxPtr)> viewFunc2 = [&bucketname](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    EXPECT_EQ(b->get(Item(string("baz"))), Item(string("3")));
+    return 0;
+  };
+  ret = db->view(viewFunc2);
+  EXPECT_EQ(ret, 0);
+  db->DbClose();
+}
+
+TEST(dbtest, mmap_reserve_test) {
+  Item bucketname(string("roland_test"));
+  Options options;
+  options.MmapReserveSize = 1 << 30;
+  std::unique_ptr<DB> db(new DB(newFileName()));
+  int ret = db->Open(options);
+  EXPECT_EQ(ret, 0);
+  std::function<int(TxPtr)> create = [&bucketname](TxPtr tx)->int {
+    auto b = tx->createBucket(bucketname);
+    return b->put(Item(string("foo")), Item(string("1")));
+  };
+  ret = db->update(create);
+  EXPECT_EQ(ret, 0);
+
+  // an open read transaction used to block the remap below forever
+  auto page0 = db->getPagePtr(0);
+  auto readTx = db->beginTx();
+  EXPECT_NE(readTx, nullptr);
+  auto value = readTx->getBucket(bucketname)->get(Item(string("foo")));
+  std::function<int(TxPtr)> grow = [&bucketname](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    for (int i = 0; i < 8; i++) {
+      auto ret = b->put(Item(string("big") + std::to_string(i)),
+                        Item(string(1 << 20, 'x')));
+      if (ret != 0) {
+        return ret;
+      }
+    }
+    return 0;
+  };
+  ret = db->update(grow);
+  EXPECT_EQ(ret, 0);
+  EXPECT_EQ(db->getPagePtr(0), page0);
+  EXPECT_EQ(value, Item(string("1")));
+  EXPECT_EQ(readTx->getBucket(bucketname)->get(Item(string("foo"))),
+            Item(string("1")));
+  db->closeTx(readTx);
+
+  std::function<int(TxPtr)> viewFunc = [&bucketname](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    EXPECT_EQ(b->get(Item(string("big7"))).length_, 1u << 20);
+    return 0;
+  };
+  ret = db->view(viewFunc);
+  EXPECT_EQ(ret, 0);
+  db->DbClose();
+}
+
+TEST(dbtest, uring_writer_test) {
+  auto name = newFileName();
+  int fd = ::open(name.c_str(), O_CREAT | O_RDWR, 0644);
+  EXPECT_GE(fd, 0);
+  // a tiny ring, so the writes go out in several submissions
+  auto writer = UringWriter::create(fd, 4);
+  if (!writer) {
+    // io_uring disabled on this kernel
+    ::close(fd);
+    ::unlink(name.c_str());
+    return;
+  }
+  std::vector<std::string> blocks;
+  std::vector<WriteRun> runs;
+  for (int i = 0; i < 10; i++) {
+    blocks.push_back(std::string(100, 'a' + i));
+  }
+  for (int i = 0; i < 10; i += 2) {
+    WriteRun run{ i * 100, 200, {} };
+    run.iov.push_back(iovec{ &blocks[i][0], 100 });
+    run.iov.push_back(iovec{ &blocks[i + 1][0], 100 });
+    runs.push_back(run);
+  }
+  EXPECT_EQ(writer->writeRuns(runs, true), 0);
+  std::string content(1000, '\0');
+  EXPECT_EQ(::pread(fd, &content[0], content.size(), 0), 1000);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(content.substr(i * 100, 100), blocks[i]);
+  }
+  ::close(fd);
+  ::unlink(name.c_str());
+
+  // a db committed through io_uring reads back the same
+  Item bucketname(string("roland_test"));
+  name = newFileName();
+  Options options;
+  options.IoUring = true;
+  {
+    std::unique_ptr<DB> db(new DB(name));
+    EXPECT_EQ(db->Open(options), 0);
+    std::function<int(TxPtr)> fill = [&bucketname](TxPtr tx)->int {
+      auto b = tx->createBucket(bucketname);
+      for (int i = 0; i < 1000; i++) {
+        auto ret = b->put(Item(std::to_string(i)), Item(string(200, 'u')));
+        if (ret != 0) {
+          return ret;
+        }
+      }
+      return 0;
+    };
+    EXPECT_EQ(db->update(fill), 0);
+    db->DbClose();
+  }
+  std::unique_ptr<DB> db(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  std::function<int(TxPtr)> viewFunc = [&bucketname](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    EXPECT_NE(b, nullptr);
+    EXPECT_EQ(b->get(Item(string("999"))), Item(string(200, 'u')));
+    return 0;
+  };
+  EXPECT_EQ(db->view(viewFunc), 0);
+  db->DbClose();
+}
+
+TEST(dbtest, direct_io_test) {
+  Item bucketname(string("roland_test"));
+  for (int ioUring = 0; ioUring < 2; ioUring++) {
+    auto name = newFileName();
+    Options options;
+    options.DirectIO = true;
+    options.IoUring = ioUring;
+    {
+      std::unique_ptr<DB> db(new DB(name));
+      EXPECT_EQ(db->Open(options), 0);
+      std::function<int(TxPtr)> fill = [&bucketname](TxPtr tx)->int {
+        auto b = tx->createBucketIfNotExists(bucketname);
+        for (int i = 0; i < 500; i++) {
+          auto ret = b->put(Item(std::to_string(i)), Item(string(300, 'd')));
+          if (ret != 0) {
+            return ret;
+          }
+        }
+        return 0;
+      };
+      EXPECT_EQ(db->update(fill), 0);
+      EXPECT_EQ(db->update(fill), 0);
+      // readers see the directly written pages through the mmap
+      std::function<int(TxPtr)> viewFunc = [&bucketname](TxPtr tx)->int {
+        EXPECT_EQ(tx->getBucket(bucketname)->get(Item(string("499"))),
+                  Item(string(300, 'd')));
+        return 0;
+      };
+      EXPECT_EQ(db->view(viewFunc), 0);
+      db->DbClose();
+    }
+    std::unique_ptr<DB> db(new DB(name));
+    EXPECT_EQ(db->Open(Options()), 0);
+    std::function<int(TxPtr)> viewFunc = [&bucketname](TxPtr tx)->int {
+      auto b = tx->getBucket(bucketname);
+      EXPECT_NE(b, nullptr);
+      EXPECT_EQ(b->get(Item(string("0"))), Item(string(300, 'd')));
+      return 0;
+    };
+    EXPECT_EQ(db->view(viewFunc), 0);
+    db->DbClose();
+  }
+}
+
+TEST(dbtest, pre_grow_test) {
+  Item bucketname(string("roland_test"));
+  auto name = newFileName();
+  Options options;
+  options.AllocSize = 1 << 20;
+  options.PreGrow = true;
+  std::unique_ptr<DB> db(new DB(name));
+  EXPECT_EQ(db->Open(options), 0);
+  int round = 0;
+  std::function<int(TxPtr)> fill = [&bucketname, &round](TxPtr tx)->int {
+    auto b = tx->createBucketIfNotExists(bucketname);
+    for (int i = 0; i < 64; i++) {
+      auto ret = b->put(Item(std::to_string(round * 64 + i)),
+                        Item(string(16 * 1024, 'g')));
+      if (ret != 0) {
+        return ret;
+      }
+    }
+    return 0;
+  };
+  for (round = 0; round < 4; round++) {
+    EXPECT_EQ(db->update(fill), 0);
+  }
+  // the background thread keeps the file ahead of the last commit
+  uint64_t used = (db->getMeta()->totalPageNumber_ + 1) * db->getPageSize();
+  struct stat st;
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(fstat(db->getFd(), &st), 0);
+    if (static_cast<uint64_t>(st.st_size) >= used + options.AllocSize) {
+      break;
+    }
+    usleep(10 * 1000);
+  }
+  EXPECT_GE(static_cast<uint64_t>(st.st_size), used + options.AllocSize);
+  // fallocate allocated the blocks, the file is not sparse
+  EXPECT_GE(static_cast<uint64_t>(st.st_blocks) * 512, used);
+  db->DbClose();
+
+  db.reset(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  std::function<int(TxPtr)> viewFunc = [&bucketname](TxPtr tx)->int {
+    EXPECT_EQ(tx->getBucket(bucketname)->get(Item(string("255"))),
+              Item(string(16 * 1024, 'g')));
+    return 0;
+  };
+  EXPECT_EQ(db->view(viewFunc), 0);
+  db->DbClose();
+}
+
+TEST(dbtest, reader_registry_test) {
+  ReaderRegistry<4> registry;
+  EXPECT_EQ(registry.minTxid(), ReaderRegistry<4>::EMPTY);
+  auto a = registry.acquire(7);
+  auto b = registry.acquire(5);
+  EXPECT_NE(a, b);
+  EXPECT_EQ(registry.minTxid(), 5u);
+  registry.publish(b, 9);
+  EXPECT_EQ(registry.minTxid(), 7u);
+  registry.release(a);
+  EXPECT_EQ(registry.minTxid(), 9u);
+  registry.release(b);
+  EXPECT_EQ(registry.minTxid(), ReaderRegistry<4>::EMPTY);
+
+  // readers beyond the slots go to the overflow list instead of waiting
+  std::vector<int> held;
+  for (uint64_t i = 0; i < 6; i++) {
+    held.push_back(registry.acquire(20 - i));
+  }
+  EXPECT_EQ(std::set<int>(held.begin(), held.end()).size(), held.size());
+  EXPECT_EQ(registry.minTxid(), 15u);
+  registry.publish(held.back(), 30);
+  EXPECT_EQ(registry.minTxid(), 16u);
+  registry.release(held[4]);
+  EXPECT_EQ(registry.minTxid(), 17u);
+  EXPECT_EQ(registry.acquire(3), held[4]);
+  EXPECT_EQ(registry.minTxid(), 3u);
+  for (auto index : held) {
+    registry.release(index);
+  }
+  EXPECT_EQ(registry.minTxid(), ReaderRegistry<4>::EMPTY);
+
+  // free slots at the end drop out of the scan and come back when reused
+  held.clear();
+  for (uint64_t i = 0; i < 3; i++) {
+    held.push_back(registry.acquire(10 + i));
+  }
+  registry.release(held[0]);
+  EXPECT_EQ(registry.minTxid(), 11u);
+  registry.release(held[1]);
+  registry.release(held[2]);
+  EXPECT_EQ(registry.minTxid(), ReaderRegistry<4>::EMPTY);
+  held.clear();
+  for (uint64_t i = 0; i < 4; i++) {
+    held.push_back(registry.acquire(4 - i));
+    EXPECT_EQ(registry.minTxid(), 4 - i);
+  }
+  for (auto index : held) {
+    registry.release(index);
+  }
+  EXPECT_EQ(registry.minTxid(), ReaderRegistry<4>::EMPTY);
+
+  // an open read transaction keeps the pages of its snapshot from reuse
+  Item bucketname(string("roland_test"));
+  std::unique_ptr<DB> db(new DB(newFileName()));
+  Options options;
+  // a remap would wait for readTx below
+  options.InitialMMapSize = 1 << 20;
+  EXPECT_EQ(db->Open(options), 0);
+  std::string value = "v0";
+  std::function<int(TxPtr)> put = [&bucketname, &value](TxPtr tx)->int {
+    auto b = tx->createBucketIfNotExists(bucketname);
+    return b->put(Item(string("foo")), Item(value));
+  };
+  EXPECT_EQ(db->update(put), 0);
+  auto readTx = db->beginTx();
+  EXPECT_NE(readTx, nullptr);
+  for (int i = 1; i < 10; i++) {
+    value = "v" + std::to_string(i);
+    EXPECT_EQ(db->update(put), 0);
+  }
+  EXPECT_EQ(readTx->getBucket(bucketname)->get(Item(string("foo"))),
+            Item(string("v0")));
+  db->closeTx(readTx);
+  std::function<int(TxPtr)> viewFunc = [&bucketname](TxPtr tx)->int {
+    EXPECT_EQ(tx->getBucket(bucketname)->get(Item(string("foo"))),
+              Item(string("v9")));
+    return 0;
+  };
+  EXPECT_EQ(db->view(viewFunc), 0);
+  db->DbClose();
+}
+
+// writers on different top level buckets run concurrently, the reservation is
+// small enough that some of them fall back to update() to remap
+TEST(dbtest, update_buckets_test) {
+  auto name = newFileName();
+  Options options;
+  options.MmapReserveSize = 2 << 20;
+  std::unique_ptr<DB> db(new DB(name));
+  EXPECT_EQ(db->Open(options), 0);
+
+  const int threads = 8, perThread = 100;
+  std::vector<std::thread> workers;
+  std::atomic<int> failed(0);
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      std::string bucketname = "tenant" + std::to_string(t);
+      std::vector<std::string> names{ bucketname };
+      std::function<int(TxPtr)> create = [&bucketname](TxPtr tx)->int {
+        return tx->createBucket(Item(bucketname)) != nullptr ? 0 : -1;
+      };
+      if (db->updateBuckets(names, create) != 0) {
+        failed++;
+      }
+      for (int i = 0; i < perThread; i++) {
+        std::function<int(TxPtr)> put = [&bucketname, t, i](TxPtr tx)->int {
+          auto b = tx->getBucket(Item(bucketname));
+          auto key = Item(std::to_string(i));
+          return b->put(key, Item(string(3000 + t, 'a' + t)));
+        };
+        if (db->updateBuckets(names, put) != 0) {
+          failed++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  EXPECT_EQ(failed, 0);
+
+  std::vector<std::string> names{ "tenant0" };
+  std::function<int(TxPtr)> undeclared = [](TxPtr tx)->int {
+    return tx->getBucket(Item(string("tenant1"))) == nullptr ? -1 : 0;
+  };
+  EXPECT_EQ(db->updateBuckets(names, undeclared), -1);
+  std::function<int(TxPtr)> rollback = [](TxPtr tx)->int {
+    tx->getBucket(Item(string("tenant0")))
+        ->put(Item(string("0")), Item(string("changed")));
+    return -1;
+  };
+  EXPECT_EQ(db->updateBuckets(names, rollback), -1);
+
+  std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+    for (int t = 0; t < threads; t++) {
+      auto b = tx->getBucket(Item("tenant" + std::to_string(t)));
+      EXPECT_NE(b, nullptr);
+      if (b == nullptr) {
+        continue;
+      }
+      for (int i = 0; i < perThread; i++) {
+        EXPECT_EQ(b->get(Item(std::to_string(i))),
+                  Item(string(3000 + t, 'a' + t)));
+      }
+    }
+    return 0;
+  };
+  EXPECT_EQ(db->view(viewFunc), 0);
+  db->DbClose();
+
+  // the freelist and meta written by group commits are consistent on reopen
+  db.reset(new DB(name));
+  EXPECT_EQ(db->Open(options), 0);
+  EXPECT_EQ(db->view(viewFunc), 0);
+  std::function<int(TxPtr)> put = [](TxPtr tx)->int {
+    return tx->getBucket(Item(string("tenant0")))
+        ->put(Item(string("new")), Item(string("value")));
+  };
+  EXPECT_EQ(db->update(put), 0);
+  db->DbClose();
+}
+
+TEST(dbtest, optimistic_update_test) {
+  auto name = newFileName();
+  DB db(name);
+  // fn pauses inside its snapshot below, growing the file must not wait for it
+  Options options;
+  options.MmapReserveSize = 1 << 26;
+  EXPECT_EQ(db.Open(options), 0);
+  Item bucket(string("occ"));
+  std::function<int(TxPtr)> create = [&bucket](TxPtr tx)->int {
+    auto b = tx->createBucket(bucket);
+    if (b == nullptr) {
+      return -1;
+    }
+    b->put(Item(string("x")), Item(string("1")));
+    return b->put(Item(string("counter")), Item(string("0")));
+  };
+  EXPECT_EQ(db.update(create), 0);
+
+  // the first run of fn waits until another transaction has committed
+  std::mutex mu;
+  std::condition_variable cond;
+  int step = 0;
+  int calls = 0;
+  auto pause = [&]() {
+    if (++calls == 1) {
+      std::unique_lock<std::mutex> lock(mu);
+      step = 1;
+      cond.notify_all();
+      cond.wait(lock, [&step] { return step == 2; });
+    }
+  };
+  auto runConcurrently = [&](std::function<int(TxPtr)> slow,
+                             std::function<int(TxPtr)> fast) {
+    step = 0;
+    calls = 0;
+    std::thread slowThread([&]() { EXPECT_EQ(db.updateOptimistic(slow), 0); });
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      cond.wait(lock, [&step] { return step == 1; });
+    }
+    EXPECT_EQ(db.updateOptimistic(fast), 0);
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      step = 2;
+      cond.notify_all();
+    }
+    slowThread.join();
+  };
+
+  // fn read x and x changed before it committed: fn runs again
+  std::function<int(TxPtr)> readX = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucket);
+    auto x = std::stoi(b->get(Item(string("x"))).toString());
+    pause();
+    return b->put(Item(string("y")), Item(std::to_string(x + 1)));
+  };
+  std::function<int(TxPtr)> writeX = [&bucket](TxPtr tx)->int {
+    return tx->getBucket(bucket)->put(Item(string("x")), Item(string("2")));
+  };
+  runConcurrently(readX, writeX);
+  EXPECT_EQ(calls, 2);
+
+  // z is only written, not read: fn is rebased instead of run again
+  std::function<int(TxPtr)> writeZ = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucket);
+    b->get(Item(string("x")));
+    pause();
+    return b->put(Item(string("z")), Item(string("first")));
+  };
+  std::function<int(TxPtr)> writeZW = [&bucket](TxPtr tx)->int {
+    auto b = tx->getBucket(bucket);
+    b->put(Item(string("z")), Item(string("second")));
+    return b->put(Item(string("w")), Item(string("1")));
+  };
+  runConcurrently(writeZ, writeZW);
+  EXPECT_EQ(calls, 1);
+
+  // read-modify-write of one counter from many threads stays serializable
+  const int threads = 8, perThread = 50;
+  std::vector<std::thread> workers;
+  std::atomic<int> failed(0);
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      for (int i = 0; i < perThread; i++) {
+        std::function<int(TxPtr)> increase = [&, t, i](TxPtr tx)->int {
+          auto b = tx->getBucket(bucket);
+          auto counter = Item(string("counter"));
+          auto value = std::stoi(b->get(counter).toString());
+          b->put(Item("t" + std::to_string(t) + "_" + std::to_string(i)),
+                 Item(string("v")));
+          return b->put(counter, Item(std::to_string(value + 1)));
+        };
+        if (db.updateOptimistic(increase) != 0) {
+          failed++;
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  EXPECT_EQ(failed, 0);
+  std::function<int(TxPtr)> commit = [](TxPtr tx)->int {
+    return tx->commit() == -1 ? 0 : -1;
+  };
+  EXPECT_EQ(db.updateOptimistic(commit), 0);
+
+  std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucket);
+    EXPECT_EQ(b->get(Item(string("y"))), Item(string("3")));
+    EXPECT_EQ(b->get(Item(string("z"))), Item(string("first")));
+    EXPECT_EQ(b->get(Item(string("w"))), Item(string("1")));
+    EXPECT_EQ(b->get(Item(string("counter"))),
+              Item(std::to_string(threads * perThread)));
+    for (int t = 0; t < threads; t++) {
+      for (int i = 0; i < perThread; i++) {
+        EXPECT_EQ(b->get(Item("t" + std::to_string(t) + "_" +
+                              std::to_string(i))),
+                  Item(string("v")));
+      }
+    }
+    return 0;
+  };
+  EXPECT_EQ(db.view(viewFunc), 0);
+  db.DbClose();
+}
+
+TEST(dbtest, pipelined_commit_test) {
+  auto name = newFileName();
+  Options options;
+  options.PipelinedCommit = true;
+  // the sync thread writes metas through the same writer as the data pages
+  options.IoUring = true;
+  std::unique_ptr<DB> db(new DB(name));
+  EXPECT_EQ(db->Open(options), 0);
+  Item bucket(string("pipeline"));
+  std::function<int(TxPtr)> create = [&bucket](TxPtr tx)->int {
+    return tx->createBucket(bucket) != nullptr ? 0 : -1;
+  };
+  EXPECT_EQ(db->update(create), 0);
+
+  const int threads = 4, perThread = 50;
+  std::vector<std::thread> workers;
+  std::atomic<int> failed(0), handled(0);
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      for (int i = 0; i < perThread; i++) {
+        Item key("k" + std::to_string(t) + "_" + std::to_string(i));
+        std::function<int(TxPtr)> put = [&](TxPtr tx)->int {
+          tx->addCommitHandle([&handled]() { handled++; });
+          return tx->getBucket(bucket)->put(key, Item(string(100, 'a' + t)));
+        };
+        if (db->update(put) != 0) {
+          failed++;
+        }
+        // acknowledged commits are visible to new readers
+        std::function<int(TxPtr)> get = [&](TxPtr tx)->int {
+          return tx->getBucket(bucket)->get(key) == Item(string(100, 'a' + t))
+                     ? 0
+                     : -1;
+        };
+        if (db->view(get) != 0) {
+          failed++;
+        }
+        // rolled back transactions in between do not lose pipelined commits
+        if (i % 10 == 0) {
+          std::function<int(TxPtr)> rollback = [&](TxPtr tx)->int {
+            tx->getBucket(bucket)->put(Item(string("rollback")), key);
+            return -1;
+          };
+          EXPECT_EQ(db->update(rollback), -1);
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  EXPECT_EQ(failed, 0);
+  EXPECT_EQ(handled, threads * perThread);
+
+  // a manually committed transaction writes its meta after the pipeline
+  auto tx = db->beginRWTx();
+  EXPECT_EQ(tx->getBucket(bucket)->put(Item(string("manual")),
+                                       Item(string("value"))),
+            0);
+  EXPECT_EQ(tx->commit(), 0);
+  db->closeTx(tx);
+
+  std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucket);
+    EXPECT_EQ(b->get(Item(string("rollback"))), Item());
+    EXPECT_EQ(b->get(Item(string("manual"))), Item(string("value")));
+    for (int t = 0; t < threads; t++) {
+      for (int i = 0; i < perThread; i++) {
+        EXPECT_EQ(b->get(Item("k" + std::to_string(t) + "_" +
+                              std::to_string(i))),
+                  Item(string(100, 'a' + t)));
+      }
+    }
+    return 0;
+  };
+  EXPECT_EQ(db->view(viewFunc), 0);
+  db->DbClose();
+
+  db.reset(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  EXPECT_EQ(db->view(viewFunc), 0);
+  db->DbClose();
+}
+
+TEST(dbtest, pipelined_optimistic_test) {
+  auto name = newFileName();
+  Options options;
+  options.PipelinedCommit = true;
+  DB db(name);
+  EXPECT_EQ(db.Open(options), 0);
+  Item bucket(string("pipeline"));
+  Item counter(string("counter"));
+  std::function<int(TxPtr)> create = [&](TxPtr tx)->int {
+    auto b = tx->createBucket(bucket);
+    return b != nullptr ? b->put(counter, Item(string("0"))) : -1;
+  };
+  EXPECT_EQ(db.update(create), 0);
+
+  // optimistic transactions snapshot the durable meta, commits still queued
+  // for fdatasync must be checked against them too
+  std::function<int(TxPtr)> increase = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucket);
+    auto value = std::stoi(b->get(counter).toString());
+    return b->put(counter, Item(std::to_string(value + 1)));
+  };
+  const int perThread = 200;
+  std::atomic<int> succeeded(0);
+  std::thread writer([&]() {
+    for (int i = 0; i < perThread; i++) {
+      if (db.update(increase) == 0) {
+        succeeded++;
+      }
+    }
+  });
+  std::thread optimistic([&]() {
+    for (int i = 0; i < perThread; i++) {
+      if (db.updateOptimistic(increase) == 0) {
+        succeeded++;
+      }
+    }
+  });
+  writer.join();
+  optimistic.join();
+  EXPECT_EQ(succeeded, 2 * perThread);
+
+  std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+    EXPECT_EQ(tx->getBucket(bucket)->get(counter).toString(),
+              std::to_string(succeeded));
+    return 0;
+  };
+  EXPECT_EQ(db.view(viewFunc), 0);
+  db.DbClose();
+}
+
+TEST(dbtest, bulk_load_test) {
+  Item bucketname(string("roland_test"));
+  auto name = newFileName();
+  std::unique_ptr<DB> db(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  const int count = 20000;
+  auto keyOf = [](int i) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "key%08d", i);
+    return string(buf);
+  };
+  // key 100 has a value larger than a page
+  auto valueOf = [](int i) {
+    return i == 100 ? string(10000, 'v') : "value" + std::to_string(i);
+  };
+  std::function<int(TxPtr)> load = [&](TxPtr tx)->int {
+    auto b = tx->createBucketIfNotExists(bucketname);
+    int i = 0;
+    auto ret = b->bulkLoad([&](Item &key, Item &value) {
+      if (i == count) {
+        return false;
+      }
+      key = Item(keyOf(i));
+      value = Item(valueOf(i));
+      i++;
+      return true;
+    }, 0.9);
+    EXPECT_EQ(ret, 0);
+    // the loaded tree is readable and writable in the same transaction
+    EXPECT_EQ(b->get(Item(keyOf(100))), Item(valueOf(100)));
+    EXPECT_EQ(b->put(Item(string("zzz")), Item(string("last"))), 0);
+    // not empty any more
+    std::function<bool(Item &, Item &)> none = [](Item &, Item &) {
+      return false;
+    };
+    EXPECT_EQ(b->bulkLoad(none), -1);
+    return ret;
+  };
+  EXPECT_EQ(db->update(load), 0);
+
+  std::function<int(TxPtr)> unsorted = [&](TxPtr tx)->int {
+    auto b = tx->createBucketIfNotExists(Item(string("unsorted")));
+    int i = 0;
+    return b->bulkLoad([&](Item &key, Item &value) {
+      if (i == 3) {
+        return false;
+      }
+      key = Item(keyOf(i == 2 ? 0 : i));
+      value = Item(string("v"));
+      i++;
+      return true;
+    });
+  };
+  EXPECT_EQ(db->update(unsorted), -1);
+
+  // a bulkLoad that fails halfway gives its pages back to the transaction
+  Item halfwayName(string("halfway"));
+  std::function<int(TxPtr)> create = [&](TxPtr tx)->int {
+    return tx->createBucket(halfwayName) != nullptr ? 0 : -1;
+  };
+  EXPECT_EQ(db->update(create), 0);
+  std::function<int(TxPtr)> noop = [](TxPtr tx)->int { return 0; };
+  EXPECT_EQ(db->update(noop), 0);
+  auto freeCount = db->getFreeList()->freeCount();
+  auto fileSize = GetFileSize(db->getFd());
+  std::function<int(TxPtr)> halfway = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(halfwayName);
+    int i = 0;
+    std::function<bool(Item &, Item &)> next = [&](Item &key, Item &value) {
+      key = Item(keyOf(i == count / 2 ? 0 : i));
+      value = Item(valueOf(i));
+      i++;
+      return true;
+    };
+    EXPECT_EQ(b->bulkLoad(next), -1);
+    return 0;
+  };
+  EXPECT_EQ(db->update(halfway), 0);
+  EXPECT_EQ(db->getFreeList()->freeCount(), freeCount);
+  EXPECT_EQ(GetFileSize(db->getFd()), fileSize);
+  db->DbClose();
+
+  db.reset(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    auto c = b->createCursor();
+    Item key;
+    Item value;
+    int i = 0;
+    for (c->first(key, value); !key.empty(); c->next(key, value), i++) {
+      if (i == count) {
+        EXPECT_EQ(key, Item(string("zzz")));
+        continue;
+      }
+      EXPECT_EQ(key, Item(keyOf(i)));
+      EXPECT_EQ(value, Item(valueOf(i)));
+    }
+    EXPECT_EQ(i, count + 1);
+    EXPECT_EQ(b->get(Item(keyOf(12345))), Item(valueOf(12345)));
+    EXPECT_EQ(tx->getBucket(Item(string("unsorted"))), nullptr);
+    return 0;
+  };
+  EXPECT_EQ(db->view(viewFunc), 0);
+  db->DbClose();
+}
+
+TEST(dbtest, append_split_test) {
+  Item bucketname(string("roland_test"));
+  auto keyOf = [](int i) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "key%08d", i);
+    return string(buf);
+  };
+  // the same sequential load with the append-aware split and with a fixed
+  // fill percent, returns the number of pages in the file
+  auto load = [&](bool fixed) {
+    std::unique_ptr<DB> db(new DB(newFileName()));
+    EXPECT_EQ(db->Open(Options()), 0);
+    for (int round = 0; round < 20; round++) {
+      std::function<int(TxPtr)> fn = [&](TxPtr tx)->int {
+        auto b = tx->createBucketIfNotExists(bucketname);
+        if (fixed) {
+          b->setFillPercent(DEFAULTFILLPERCENT);
+        }
+        for (int i = round * 500; i < (round + 1) * 500; i++) {
+          b->put(Item(keyOf(i)), Item(string(32, 'v')));
+        }
+        EXPECT_EQ(b->splitFillPercent(),
+                  fixed ? DEFAULTFILLPERCENT : MAXFILLPERCENT);
+        return 0;
+      };
+      EXPECT_EQ(db->update(fn), 0);
+    }
+    std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+      auto c = tx->getBucket(bucketname)->createCursor();
+      Item key;
+      Item value;
+      int i = 0;
+      for (c->first(key, value); !key.empty(); c->next(key, value), i++) {
+        EXPECT_EQ(key, Item(keyOf(i)));
+      }
+      EXPECT_EQ(i, 20 * 500);
+      return 0;
+    };
+    EXPECT_EQ(db->view(viewFunc), 0);
+    auto pages = db->getMeta()->totalPageNumber_;
+    db->DbClose();
+    return pages;
+  };
+  auto appendPages = load(false);
+  auto fixedPages = load(true);
+  EXPECT_LT(appendPages * 4, fixedPages * 3);
+
+  // a put in the middle falls back to the bucket's fill percent
+  std::unique_ptr<DB> db(new DB(newFileName()));
+  EXPECT_EQ(db->Open(Options()), 0);
+  std::function<int(TxPtr)> mixed = [&](TxPtr tx)->int {
+    auto b = tx->createBucketIfNotExists(bucketname);
+    b->put(Item(keyOf(1)), Item(string("v")));
+    b->put(Item(keyOf(3)), Item(string("v")));
+    EXPECT_EQ(b->splitFillPercent(), MAXFILLPERCENT);
+    b->put(Item(keyOf(2)), Item(string("v")));
+    EXPECT_EQ(b->splitFillPercent(), DEFAULTFILLPERCENT);
+    return 0;
+  };
+  EXPECT_EQ(db->update(mixed), 0);
+  db->DbClose();
+}
+
+TEST(dbtest, append_fast_path_test) {
+  Item bucketname(string("roland_test"));
+  auto name = newFileName();
+  std::unique_ptr<DB> db(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  auto keyOf = [](int i) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "key%08d", i);
+    return string(buf);
+  };
+  const int count = 5000;
+  // even keys are appended, odd keys are put in the middle afterwards and
+  // some appended keys are overwritten
+  for (int round = 0; round < 2; round++) {
+    std::function<int(TxPtr)> fn = [&](TxPtr tx)->int {
+      auto b = tx->createBucketIfNotExists(bucketname);
+      int begin = round * count / 2;
+      for (int i = begin; i < begin + count / 2; i += 2) {
+        EXPECT_EQ(b->put(Item(keyOf(i)), Item(keyOf(i))), 0);
+      }
+      EXPECT_EQ(b->put(Item(keyOf(begin + 1)), Item(keyOf(begin + 1))), 0);
+      EXPECT_EQ(b->put(Item(keyOf(begin)), Item(string("new"))), 0);
+      for (int i = begin + 3; i < begin + count / 2; i += 2) {
+        EXPECT_EQ(b->put(Item(keyOf(i)), Item(keyOf(i))), 0);
+      }
+      EXPECT_EQ(b->get(Item(keyOf(begin + 100))), Item(keyOf(begin + 100)));
+      return 0;
+    };
+    EXPECT_EQ(db->update(fn), 0);
+  }
+  db->DbClose();
+
+  db.reset(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+    auto c = tx->getBucket(bucketname)->createCursor();
+    Item key;
+    Item value;
+    int i = 0;
+    for (c->first(key, value); !key.empty(); c->next(key, value), i++) {
+      EXPECT_EQ(key, Item(keyOf(i)));
+      if (i % (count / 2) == 0) {
+        EXPECT_EQ(value, Item(string("new")));
+      } else {
+        EXPECT_EQ(value, Item(keyOf(i)));
+      }
+    }
+    EXPECT_EQ(i, count);
+    return 0;
+  };
+  EXPECT_EQ(db->view(viewFunc), 0);
+  db->DbClose();
+}
+
+TEST(dbtest, prefix_compression_test) {
+  Item bucketname(string("roland_test"));
+  auto name = newFileName();
+  std::unique_ptr<DB> db(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  auto keyOf = [](int i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "tenant-0001/table-orders/%08d", i * 2);
+    return string(buf);
+  };
+  const int count = 5000;
+  std::function<int(TxPtr)> load = [&](TxPtr tx)->int {
+    auto b = tx->createBucketIfNotExists(bucketname);
+    for (int i = 0; i < count; i++) {
+      EXPECT_EQ(b->put(Item(keyOf(i)), Item(std::to_string(i))), 0);
+    }
+    return 0;
+  };
+  EXPECT_EQ(db->update(load), 0);
+  EXPECT_EQ(db->getMeta()->version_, VERSION);
+
+  // seek on pages, keys inside and outside of the pages' common prefix
+  std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    auto root = tx->getPage(b->getRootPage());
+    EXPECT_TRUE(root->flag & pageFlags::prefixPageFlag);
+    auto c = b->createCursor();
+    Item key;
+    Item value;
+    uint32_t flag;
+    c->seek(Item(string("a")), key, value, flag);
+    EXPECT_EQ(key, Item(keyOf(0)));
+    c->seek(Item(string("tenant-0001/table-orders")), key, value, flag);
+    EXPECT_EQ(key, Item(keyOf(0)));
+    c->seek(Item(keyOf(1234) + "x"), key, value, flag);
+    EXPECT_EQ(key, Item(keyOf(1235)));
+    c->seek(Item(keyOf(777)), key, value, flag);
+    EXPECT_EQ(value, Item(string("777")));
+    c->seek(Item(string("z")), key, value, flag);
+    EXPECT_TRUE(key.empty());
+    int i = count;
+    for (c->last(key, value); !key.empty(); c->prev(key, value)) {
+      EXPECT_EQ(key, Item(keyOf(--i)));
+    }
+    EXPECT_EQ(i, 0);
+    return 0;
+  };
+  EXPECT_EQ(db->view(viewFunc), 0);
+
+  // rewrite the pages from nodes read back from compressed pages
+  std::function<int(TxPtr)> update = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    for (int i = 0; i < count; i += 3) {
+      EXPECT_EQ(b->put(Item(keyOf(i)), Item(std::to_string(i))), 0);
+    }
+    EXPECT_EQ(b->remove(Item(keyOf(count - 1))), 0);
+    EXPECT_EQ(b->put(Item(string("zz-other")), Item(string("x"))), 0);
+    return 0;
+  };
+  EXPECT_EQ(db->update(update), 0);
+  db->DbClose();
+
+  db.reset(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  std::function<int(TxPtr)> check = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    auto c = b->createCursor();
+    Item key;
+    Item value;
+    int i = 0;
+    for (c->first(key, value); !key.empty(); c->next(key, value), i++) {
+      if (i == count - 1) {
+        EXPECT_EQ(key, Item(string("zz-other")));
+        continue;
+      }
+      EXPECT_EQ(key, Item(keyOf(i)));
+      EXPECT_EQ(value, Item(std::to_string(i)));
+    }
+    EXPECT_EQ(i, count);
+    EXPECT_EQ(b->get(Item(keyOf(4321))), Item(string("4321")));
+    return 0;
+  };
+  EXPECT_EQ(db->view(check), 0);
+  db->DbClose();
+}
+
+TEST(dbtest, separator_truncation_test) {
+  Item bucketname(string("roland_test"));
+  auto name = newFileName();
+  std::unique_ptr<DB> db(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  // long keys that differ early, the separators only need a few bytes
+  auto keyOf = [](int i) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08d", i);
+    return string(buf) + string(192, 'k');
+  };
+  std::map<string, string> expected;
+  srand(0);
+  for (int round = 0; round < 10; round++) {
+    std::function<int(TxPtr)> fn = [&](TxPtr tx)->int {
+      auto b = tx->createBucketIfNotExists(bucketname);
+      for (int i = 0; i < 500; i++) {
+        auto key = keyOf(rand() % 4000);
+        if (round > 5 && rand() % 2 == 0) {
+          EXPECT_EQ(b->remove(Item(key)), 0);
+          expected.erase(key);
+          continue;
+        }
+        EXPECT_EQ(b->put(Item(key), Item(std::to_string(round))), 0);
+        expected[key] = std::to_string(round);
+      }
+      return 0;
+    };
+    EXPECT_EQ(db->update(fn), 0);
+  }
+  db->DbClose();
+
+  db.reset(new DB(name));
+  EXPECT_EQ(db->Open(Options()), 0);
+  std::function<int(TxPtr)> viewFunc = [&](TxPtr tx)->int {
+    auto b = tx->getBucket(bucketname);
+    auto root = tx->getPage(b->getRootPage());
+    EXPECT_TRUE(root->flag & pageFlags::branchPageFlag);
+    for (uint32_t i = 1; i < root->count; i++) {
+      auto element = root->getBranchPageElement(i);
+      EXPECT_LT(root->fullKey(element->keyPtr(), element->ksize).length_, 16u);
+    }
+    auto c = b->createCursor();
+    Item key;
+    Item value;
+    auto it = expected.begin();
+    for (c->first(key, value); !key.empty(); c->next(key, value), it++) {
+      EXPECT_EQ(key, Item(it->first));
+      EXPECT_EQ(value, Item(it->second));
+    }
+    EXPECT_TRUE(it == expected.end());
+    for (int i = 0; i < 4000; i += 7) {
+      auto found = expected.find(keyOf(i));
+      EXPECT_EQ(b->get(Item(keyOf(i))),
+                found == expected.end() ? Item() : Item(found->second));
+    }
+    return 0;
+  };
+  EXPECT_EQ(db->view(viewFunc), 0);
+  db->DbClose();
+}